@@ -2,12 +2,52 @@
 
 #define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE_EXTENDED // wide characters in ncurses
 
+#include "tetrominoes.h"
+
+#ifndef TETRIS_LIBRARY
 #include <ncurses.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef RNG_HARNESS
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef BENCH
+#include <time.h>
+#endif
+
+#ifdef LATENCY_HARNESS
+#include <dirent.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#endif
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 
@@ -15,14 +55,37 @@
 
 // Defines
 
-#define DELAY_US 30000L
 #define INPUT_TIME_US 100000L
 
-#define TETRIS_PLAYFIELD_X 10
-#define TETRIS_PLAYFIELD_Y 40 // this will be drawn as half this value but internally as this value
+// Without the kitty keyboard protocol there are no key releases, so a key
+// counts as held only while the terminal's autorepeat keeps sending it, and
+// its presses are only taken for autorepeat once they have been coming for
+// longer than terminals wait before they start repeating
+#define LEGACY_HOLD_GAP_US 100000L
+#define LEGACY_REPEAT_DELAY_US 200000L
+
+// After falling this many ticks behind, the rest are dropped instead of run
+#define TICK_MAX_CATCH_UP 10
+// Tick lateness is recorded in buckets of powers of two microseconds
+#define TICK_LATE_BUCKETS 20
+// Frame phases are timed in buckets of powers of two nanoseconds
+#define PHASE_BUCKETS 32
+#define PHASE_OVERLAY_KEY 'd'
+// Trace events kept when tracing, the oldest ones are overwritten
+#define TRACE_EVENTS (1 << 18)
+#define TRACE_ENV "TETROMINOES_TRACE"
+
+// Every playfield row is a bitboard word where column x is bit x+PLAYFIELD_ROW_SHIFT.
+// All the bits outside of the playfield are always set, so the walls (and the
+// floor rows below the playfield) collide just like any other block.
+#define PLAYFIELD_ROW_SHIFT 4
+#define PLAYFIELD_ROW_CELLS (((1U << TETRIS_PLAYFIELD_X) - 1) << PLAYFIELD_ROW_SHIFT)
+#define PLAYFIELD_ROW_EMPTY (~PLAYFIELD_ROW_CELLS)
+#define PLAYFIELD_ROW_FULL (~0U)
 
 #define NEXT_RECTANGLE_DRAW_X 12
 #define NEXT_RECTANGLE_DRAW_Y 16
+#define NEXT_RECTANGLE_DRAW_Y_HALF_BLOCKS 8
 
 #define SCORE_RECTANGLE_DRAW_X 12
 #define SCORE_RECTANGLE_DRAW_Y 2
@@ -32,11 +95,15 @@
 
 #define HOLD_RECTANGLE_DRAW_X 12
 #define HOLD_RECTANGLE_DRAW_Y 6
+#define HOLD_RECTANGLE_DRAW_Y_HALF_BLOCKS 4
 
 #define GAMEOVER_RECTANGLE_DRAW_X 60
 #define GAMEOVER_RECTANGLE_DRAW_Y 8
+#define GAMEOVER_TEXT "GAME OVER"
+#define PAUSED_TEXT "PAUSED"
 
 #define DRAWING_CHAR '#'
+#define UPPER_HALF_BLOCK 0x2580 // ▀
 
 #define SINGLE_SCORE 100
 #define DOUBLE_SCORE 300
@@ -51,1642 +118,4546 @@
 #define TRIPLE_LEVEL_SCORE 5
 #define TETRIS_LEVEL_SCORE 8
 
+// Gravity is how many rows the piece falls each tick, in 16.16 fixed point.
+// GRAVITY() turns the time it takes to fall one row into that.
+#define GRAVITY_ONE_ROW (1U << 16)
+#define GRAVITY(us_per_row) ((uint32_t)(((uint64_t)TETRIS_TICK_US << 16) / (us_per_row)))
+// 20 rows per 1/60 s frame: as fast as it gets, pieces land on the tick they start falling
+#define GRAVITY_20G GRAVITY(1000000 / 60 / 20)
+#define GRAVITY_LEVELS 20
+
 #define MAX_TOTAL_HISCORE_FILEPATH_LENGTH 1024
 #define HISCORE_FILE "tetrominoes/hiscore.txt"
+#define PHASES_FILE "tetrominoes/phases.txt"
+#define LEADERBOARD_FILE "tetrominoes/leaderboard.bin"
+#define DATA_LOCK_FILE "tetrominoes/data.lock"
+#define LEADERBOARD_MAGIC 0x4c425454 // "TTBL" when little endian
+#define LEADERBOARD_VERSION 1
+#define LEADERBOARD_ENTRIES 10
+#define HISTORY_FILE "tetrominoes/history.bin"
+#define HISTORY_INDEX_FILE "tetrominoes/history.idx"
+#define HISTORY_INDEX_MAGIC 0x58495454 // "TTIX" when little endian
+#define HISTORY_INDEX_VERSION 2
+// The index is only rewritten when the history reaches a multiple of this
+#define HISTORY_INDEX_INTERVAL 1024
+#define SAVE_FILE "tetrominoes/save.bin"
+#define SAVE_MAGIC 0x56535454 // "TTSV" when little endian
+#define SAVE_VERSION 1
+#define REPLAY_MAGIC "TTRP"
+#define REPLAY_VERSION 2
+#define REPLAY_BUFFER_SIZE 65536
+#define REPLAY_INPUT_BITS 4
+
+// Piece shapes are written as four rows of four cells, and each row becomes a
+// mask with bit i set when the cell in column i is filled. The bounding box is
+// worked out from those masks, so the whole table is built by the compiler.
+#define ROW(a,b,c,d) ((a) | (b) << 1 | (c) << 2 | (d) << 3)
+#define ROWS_TOP(r0,r1,r2,r3) ((r0) ? 0 : (r1) ? 1 : (r2) ? 2 : 3)
+#define ROWS_BOTTOM(r0,r1,r2,r3) ((r3) ? 3 : (r2) ? 2 : (r1) ? 1 : 0)
+#define COLUMNS_LEFT(m) (((m) & 1) ? 0 : ((m) & 2) ? 1 : ((m) & 4) ? 2 : 3)
+#define COLUMNS_RIGHT(m) (((m) & 8) ? 3 : ((m) & 4) ? 2 : ((m) & 2) ? 1 : 0)
+#define CELL(r,i) (((r) >> (i)) & 1)
+#define COLUMN_TOP(r0,r1,r2,r3,i)                                               \
+        (CELL(r0,i) ? 0 : CELL(r1,i) ? 1 : CELL(r2,i) ? 2 : CELL(r3,i) ? 3 : -1)
+#define COLUMN_BOTTOM(r0,r1,r2,r3,i)                                            \
+        (CELL(r3,i) ? 3 : CELL(r2,i) ? 2 : CELL(r1,i) ? 1 : CELL(r0,i) ? 0 : -1)
+#define SHAPE(r0,r1,r2,r3) {                                    \
+                { (r0), (r1), (r2), (r3) },                     \
+                ROWS_TOP(r0,r1,r2,r3),                          \
+                ROWS_BOTTOM(r0,r1,r2,r3),                       \
+                COLUMNS_LEFT((r0) | (r1) | (r2) | (r3)),        \
+                COLUMNS_RIGHT((r0) | (r1) | (r2) | (r3)),       \
+                {                                               \
+                        COLUMN_TOP(r0,r1,r2,r3,0),              \
+                        COLUMN_TOP(r0,r1,r2,r3,1),              \
+                        COLUMN_TOP(r0,r1,r2,r3,2),              \
+                        COLUMN_TOP(r0,r1,r2,r3,3)               \
+                },                                              \
+                {                                               \
+                        COLUMN_BOTTOM(r0,r1,r2,r3,0),           \
+                        COLUMN_BOTTOM(r0,r1,r2,r3,1),           \
+                        COLUMN_BOTTOM(r0,r1,r2,r3,2),           \
+                        COLUMN_BOTTOM(r0,r1,r2,r3,3)            \
+                }                                               \
+        }
 
+// Kick tables are written like the guideline ones, with up as positive, and
+// flipped here so that they can be added to a location straight away
+#define KICK(x, y) {(x), -(y)}
+#define KICKS(a, b, c, d, e) {5, {a, b, c, d, e}}
+#define NO_KICKS {1, {KICK(0,0)}}
+#define NO_KICKS_PIECE {                                        \
+                {NO_KICKS, NO_KICKS}, {NO_KICKS, NO_KICKS},     \
+                {NO_KICKS, NO_KICKS}, {NO_KICKS, NO_KICKS}      \
+        }
 
+// From each rotation, clockwise then counterclockwise
+#define SRS_JLSTZ_KICKS {                                                                               \
+                {KICKS(KICK(0,0), KICK(-1,0), KICK(-1, 1), KICK(0,-2), KICK(-1,-2)),  /* 0 => 1 */       \
+                 KICKS(KICK(0,0), KICK( 1,0), KICK( 1, 1), KICK(0,-2), KICK( 1,-2))}, /* 0 => 3 */       \
+                {KICKS(KICK(0,0), KICK( 1,0), KICK( 1,-1), KICK(0, 2), KICK( 1, 2)),  /* 1 => 2 */       \
+                 KICKS(KICK(0,0), KICK( 1,0), KICK( 1,-1), KICK(0, 2), KICK( 1, 2))}, /* 1 => 0 */       \
+                {KICKS(KICK(0,0), KICK( 1,0), KICK( 1, 1), KICK(0,-2), KICK( 1,-2)),  /* 2 => 3 */       \
+                 KICKS(KICK(0,0), KICK(-1,0), KICK(-1, 1), KICK(0,-2), KICK(-1,-2))}, /* 2 => 1 */       \
+                {KICKS(KICK(0,0), KICK(-1,0), KICK(-1,-1), KICK(0, 2), KICK(-1, 2)),  /* 3 => 0 */       \
+                 KICKS(KICK(0,0), KICK(-1,0), KICK(-1,-1), KICK(0, 2), KICK(-1, 2))}  /* 3 => 2 */       \
+        }
 
-// enums, structs
+#define SRS_I_KICKS {                                                                                   \
+                {KICKS(KICK(0,0), KICK(-2,0), KICK( 1,0), KICK(-2,-1), KICK( 1, 2)),  /* 0 => 1 */       \
+                 KICKS(KICK(0,0), KICK(-1,0), KICK( 2,0), KICK(-1, 2), KICK( 2,-1))}, /* 0 => 3 */       \
+                {KICKS(KICK(0,0), KICK(-1,0), KICK( 2,0), KICK(-1, 2), KICK( 2,-1)),  /* 1 => 2 */       \
+                 KICKS(KICK(0,0), KICK( 2,0), KICK(-1,0), KICK( 2, 1), KICK(-1,-2))}, /* 1 => 0 */       \
+                {KICKS(KICK(0,0), KICK( 2,0), KICK(-1,0), KICK( 2, 1), KICK(-1,-2)),  /* 2 => 3 */       \
+                 KICKS(KICK(0,0), KICK( 1,0), KICK(-2,0), KICK( 1,-2), KICK(-2, 1))}, /* 2 => 1 */       \
+                {KICKS(KICK(0,0), KICK( 1,0), KICK(-2,0), KICK( 1,-2), KICK(-2, 1)),  /* 3 => 0 */       \
+                 KICKS(KICK(0,0), KICK(-2,0), KICK( 1,0), KICK(-2,-1), KICK( 1, 2))}  /* 3 => 2 */       \
+        }
+
+// SRS+ only changes the I piece, so that its kicks are the same both ways
+#define SRS_PLUS_I_KICKS {                                                                              \
+                {KICKS(KICK(0,0), KICK( 1,0), KICK(-2,0), KICK(-2,-1), KICK( 1, 2)),  /* 0 => 1 */       \
+                 KICKS(KICK(0,0), KICK(-1,0), KICK( 2,0), KICK( 2,-1), KICK(-1, 2))}, /* 0 => 3 */       \
+                {KICKS(KICK(0,0), KICK(-1,0), KICK( 2,0), KICK(-1, 2), KICK( 2,-1)),  /* 1 => 2 */       \
+                 KICKS(KICK(0,0), KICK(-1,0), KICK( 2,0), KICK(-1,-2), KICK( 2, 1))}, /* 1 => 0 */       \
+                {KICKS(KICK(0,0), KICK( 2,0), KICK(-1,0), KICK( 2, 1), KICK(-1,-2)),  /* 2 => 3 */       \
+                 KICKS(KICK(0,0), KICK(-2,0), KICK( 1,0), KICK(-2, 1), KICK( 1,-2))}, /* 2 => 1 */       \
+                {KICKS(KICK(0,0), KICK( 1,0), KICK(-2,0), KICK( 1,-2), KICK(-2, 1)),  /* 3 => 0 */       \
+                 KICKS(KICK(0,0), KICK( 1,0), KICK(-2,0), KICK( 1, 2), KICK(-2,-1))}  /* 3 => 2 */       \
+        }
+
+// ARS just tries one cell right and then one cell left, and the I piece never kicks
+#define ARS_KICK_LIST {3, {KICK(0,0), KICK(1,0), KICK(-1,0)}}
+#define ARS_KICKS {                                             \
+                {ARS_KICK_LIST, ARS_KICK_LIST},                 \
+                {ARS_KICK_LIST, ARS_KICK_LIST},                 \
+                {ARS_KICK_LIST, ARS_KICK_LIST},                 \
+                {ARS_KICK_LIST, ARS_KICK_LIST}                  \
+        }
 
-enum tetris_color {
-        TETRIS_COLOR_BLACK,
-        TETRIS_COLOR_CYAN,
-        TETRIS_COLOR_YELLOW,
-        TETRIS_COLOR_PURPLE,
-        TETRIS_COLOR_GREEN,
-        TETRIS_COLOR_RED,
-        TETRIS_COLOR_BLUE,
-        TETRIS_COLOR_ORANGE,
-        TETRIS_COLOR_WHITE
-};
 
-enum tetrimino {
-        TETRIMINO_TEST,
-        TETRIMINO_I,
-        TETRIMINO_O,
-        TETRIMINO_T,
-        TETRIMINO_S,
-        TETRIMINO_Z,
-        TETRIMINO_J,
-        TETRIMINO_L
+
+// Structs
+
+struct piece_shape {
+        uint8_t rows[4];
+        
+        // bounding box, inclusive
+        int8_t top;
+        int8_t bottom;
+        int8_t left;
+        int8_t right;
+
+        // highest and lowest filled row of each column, -1 if it's empty
+        int8_t column_tops[4];
+        int8_t column_bottoms[4];
 };
 
-enum tetrimino_rotation {
-        SPAWN_ROTATED,
-        CLOCKWISE_ROTATED,
-        TWICE_ROTATED,
-        COUNTER_ROTATED
+enum rotation_direction {
+        ROTATE_CLOCKWISE,
+        ROTATE_COUNTERCLOCKWISE
 };
 
-enum input_type {
-        INPUT_NONE,
-        INPUT_CLOCKWISE_ROTATION,
-        INPUT_HARD_DROP,
-        INPUT_HOLD,
-        INPUT_COUNTERCLOCKWISE_ROTATION,
-        INPUT_SOFT_DROP,
-        INPUT_LEFT,
-        INPUT_RIGHT,
-        INPUT_PAUSE,
-        INPUT_EXIT
+// Offsets to try in order when rotating, the first one that fits wins
+struct kick_list {
+        int8_t count;
+        struct {
+                int8_t x;
+                int8_t y;
+        } tests[5];
 };
 
-struct point {
-        int x;
-        int y;
+// What can show up in a trace, both spans and instants
+enum trace_name {
+        // frame phases
+        TRACE_WAIT,
+        TRACE_STEP,
+        TRACE_INPUT,
+        TRACE_DRAW,
+        TRACE_PRESENT,
+        // other spans
+        TRACE_CLEAR_LINES,
+        TRACE_HISCORE_SAVE,
+        // instants
+        TRACE_LOCK,
+        TRACE_HOLD,
+        TRACE_LINE_CLEAR,
+        TRACE_LEVEL_UP,
+        TRACE_NAMES
 };
 
+// The engine marks what it does with these, and the game records it when
+// tracing is on (see the Trace functions). The library leaves them out.
+#ifdef TETRIS_LIBRARY
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_INSTANT(name) ((void)0)
+#else
+static bool tracing;
+static void trace_begin(enum trace_name name);
+static void trace_end(enum trace_name name);
+static void trace_instant(enum trace_name name);
+#define TRACE_BEGIN(name) do { if (tracing) trace_begin(name); } while (0)
+#define TRACE_END(name) do { if (tracing) trace_end(name); } while (0)
+#define TRACE_INSTANT(name) do { if (tracing) trace_instant(name); } while (0)
+#endif
+
 
 
 // Globals (constants)
 
-static const bool piece_shapes[8][4][4][4] = {
+static const struct piece_shape piece_shapes[8][4] = {
         {
-                {
-                        {1,1,1,1},
-                        {1,1,1,1},
-                        {1,1,1,1},
-                        {1,1,1,1}
-                },
-                {
-                        {1,1,1,1},
-                        {1,1,1,1},
-                        {1,1,1,1},
-                        {1,1,1,1}
-                },
-                {
-                        {1,1,1,1},
-                        {1,1,1,1},
-                        {1,1,1,1},
-                        {1,1,1,1}
-                },
-                {
-                        {1,1,1,1},
-                        {1,1,1,1},
-                        {1,1,1,1},
-                        {1,1,1,1}
-                }
+                SHAPE(ROW(1,1,1,1),
+                      ROW(1,1,1,1),
+                      ROW(1,1,1,1),
+                      ROW(1,1,1,1)),
+                SHAPE(ROW(1,1,1,1),
+                      ROW(1,1,1,1),
+                      ROW(1,1,1,1),
+                      ROW(1,1,1,1)),
+                SHAPE(ROW(1,1,1,1),
+                      ROW(1,1,1,1),
+                      ROW(1,1,1,1),
+                      ROW(1,1,1,1)),
+                SHAPE(ROW(1,1,1,1),
+                      ROW(1,1,1,1),
+                      ROW(1,1,1,1),
+                      ROW(1,1,1,1))
         },
         {
-                {
-                        {0,0,0,0},
-                        {1,1,1,1},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,0,1,0},
-                        {0,0,1,0},
-                        {0,0,1,0},
-                        {0,0,1,0}
-                },
-                {
-                        {0,0,0,0},
-                        {0,0,0,0},
-                        {1,1,1,1},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,0,0},
-                        {0,1,0,0},
-                        {0,1,0,0},
-                        {0,1,0,0}
-                }
+                SHAPE(ROW(0,0,0,0),
+                      ROW(1,1,1,1),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,0,1,0),
+                      ROW(0,0,1,0),
+                      ROW(0,0,1,0),
+                      ROW(0,0,1,0)),
+                SHAPE(ROW(0,0,0,0),
+                      ROW(0,0,0,0),
+                      ROW(1,1,1,1),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(0,1,0,0))
         },
         {
-                {
-                        {0,1,1,0},
-                        {0,1,1,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,1,0},
-                        {0,1,1,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,1,0},
-                        {0,1,1,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,1,0},
-                        {0,1,1,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                }
+                SHAPE(ROW(0,1,1,0),
+                      ROW(0,1,1,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,1,0),
+                      ROW(0,1,1,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,1,0),
+                      ROW(0,1,1,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,1,0),
+                      ROW(0,1,1,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0))
         },
         {
-                {
-                        {0,1,0,0},
-                        {1,1,1,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,0,0},
-                        {0,1,1,0},
-                        {0,1,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,0,0,0},
-                        {1,1,1,0},
-                        {0,1,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,0,0},
-                        {1,1,0,0},
-                        {0,1,0,0},
-                        {0,0,0,0}
-                }
+                SHAPE(ROW(0,1,0,0),
+                      ROW(1,1,1,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,0,0),
+                      ROW(0,1,1,0),
+                      ROW(0,1,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,0,0,0),
+                      ROW(1,1,1,0),
+                      ROW(0,1,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,0,0),
+                      ROW(1,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(0,0,0,0))
         },
         {
-                {
-                        {0,1,1,0},
-                        {1,1,0,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,0,0},
-                        {0,1,1,0},
-                        {0,0,1,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,0,0,0},
-                        {0,1,1,0},
-                        {1,1,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {1,0,0,0},
-                        {1,1,0,0},
-                        {0,1,0,0},
-                        {0,0,0,0}
-                }
+                SHAPE(ROW(0,1,1,0),
+                      ROW(1,1,0,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,0,0),
+                      ROW(0,1,1,0),
+                      ROW(0,0,1,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,0,0,0),
+                      ROW(0,1,1,0),
+                      ROW(1,1,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(1,0,0,0),
+                      ROW(1,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(0,0,0,0))
         },
         {
-                {
-                        {1,1,0,0},
-                        {0,1,1,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,0,1,0},
-                        {0,1,1,0},
-                        {0,1,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,0,0,0},
-                        {1,1,0,0},
-                        {0,1,1,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,0,0},
-                        {1,1,0,0},
-                        {1,0,0,0},
-                        {0,0,0,0}
-                }
+                SHAPE(ROW(1,1,0,0),
+                      ROW(0,1,1,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,0,1,0),
+                      ROW(0,1,1,0),
+                      ROW(0,1,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,0,0,0),
+                      ROW(1,1,0,0),
+                      ROW(0,1,1,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,0,0),
+                      ROW(1,1,0,0),
+                      ROW(1,0,0,0),
+                      ROW(0,0,0,0))
         },
         {
-                {
-                        {1,0,0,0},
-                        {1,1,1,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,1,0},
-                        {0,1,0,0},
-                        {0,1,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,0,0,0},
-                        {1,1,1,0},
-                        {0,0,1,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,0,0},
-                        {0,1,0,0},
-                        {1,1,0,0},
-                        {0,0,0,0}
-                }
+                SHAPE(ROW(1,0,0,0),
+                      ROW(1,1,1,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,1,0),
+                      ROW(0,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,0,0,0),
+                      ROW(1,1,1,0),
+                      ROW(0,0,1,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(1,1,0,0),
+                      ROW(0,0,0,0))
         },
         {
-                {
-                        {0,0,1,0},
-                        {1,1,1,0},
-                        {0,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,1,0,0},
-                        {0,1,0,0},
-                        {0,1,1,0},
-                        {0,0,0,0}
-                },
-                {
-                        {0,0,0,0},
-                        {1,1,1,0},
-                        {1,0,0,0},
-                        {0,0,0,0}
-                },
-                {
-                        {1,1,0,0},
-                        {0,1,0,0},
-                        {0,1,0,0},
-                        {0,0,0,0}
-                }
+                SHAPE(ROW(0,0,1,0),
+                      ROW(1,1,1,0),
+                      ROW(0,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(0,1,1,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(0,0,0,0),
+                      ROW(1,1,1,0),
+                      ROW(1,0,0,0),
+                      ROW(0,0,0,0)),
+                SHAPE(ROW(1,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(0,1,0,0),
+                      ROW(0,0,0,0))
         }
 };
 
-static const struct point wall_kicks[2][8][5] = {
-        // All pieces except O and I
-        {
-                // 0 => 1
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {-1,0},
-                        
-                        // Test 3
-                        {-1,1},
-                        
-                        // Test 4
-                        {0,-2},
-                        
-                        // Test 5
-                        {-1,-2}
-                },
-                
-                // 1 => 0
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {1,0},
-                        
-                        // Test 3
-                        {1,-1},
-                        
-                        // Test 4
-                        {0,2},
-                        
-                        // Test 5
-                        {1,2}
-                },
-                
-                // 1 => 2
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {1,0},
-                        
-                        // Test 3
-                        {1,-1},
-                        
-                        // Test 4
-                        {0,2},
-                        
-                        // Test 5
-                        {1,2}
-                },
-                
-                // 2 => 1
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {-1,0},
-                        
-                        // Test 3
-                        {-1,1},
-                        
-                        // Test 4
-                        {0,-2},
-                        
-                        // Test 5
-                        {-1,-2}
-                },
-                
-                // 2 => 3
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {1,0},
-                        
-                        // Test 3
-                        {1,1},
-                        
-                        // Test 4
-                        {0,-2},
-                        
-                        // Test 5
-                        {1,-2}
-                },
-                
-                // 3 => 2
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {-1,0},
-                        
-                        // Test 3
-                        {-1,-1},
-                        
-                        // Test 4
-                        {0,2},
-                        
-                        // Test 5
-                        {-1,2}
-                },
-                
-                // 3 => 0
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {-1,0},
-                        
-                        // Test 3
-                        {-1,-1},
-                        
-                        // Test 4
-                        {0,2},
-                        
-                        // Test 5
-                        {-1,2}
-                },
-                
-                // 0 => 3
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {1,0},
-                        
-                        // Test 3
-                        {1,1},
-                        
-                        // Test 4
-                        {0,-2},
-                        
-                        // Test 5
-                        {1,-2}
-                }
-        },
+// Time to fall one row at each level, (0.8 - (level-1) * 0.007) ^ (level-1)
+// seconds as per the guideline. Levels beyond the table keep the last one.
+static const uint32_t gravity_table[GRAVITY_LEVELS] = {
+        GRAVITY(1000000), GRAVITY(793000), GRAVITY(617796), GRAVITY(472729),
+        GRAVITY(355197), GRAVITY(262004), GRAVITY(189677), GRAVITY(134735),
+        GRAVITY(93882), GRAVITY(64152), GRAVITY(42976), GRAVITY(28218),
+        GRAVITY(18153), GRAVITY(11439), GRAVITY(7059), GRAVITY(4264),
+        GRAVITY(2520), GRAVITY(1457), GRAVITY(824), GRAVITY(455)
+};
 
-        // I piece
-        {
-                // 0 => 1
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {-2,0},
-                        
-                        // Test 3
-                        {1,0},
-                        
-                        // Test 4
-                        {-2,-1},
-                        
-                        // Test 5
-                        {1,2}
-                },
-                
-                // 1 => 0
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {2,0},
-                        
-                        // Test 3
-                        {-1,0},
-                        
-                        // Test 4
-                        {2,1},
-                        
-                        // Test 5
-                        {-1,-2}
-                },
-                
-                // 1 => 2
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {-1,0},
-                        
-                        // Test 3
-                        {2,0},
-                        
-                        // Test 4
-                        {-1,2},
-                        
-                        // Test 5
-                        {2,-1}
-                },
-                
-                // 2 => 1
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {1,0},
-                        
-                        // Test 3
-                        {-2,0},
-                        
-                        // Test 4
-                        {1,-2},
-                        
-                        // Test 5
-                        {-2,1}
-                },
-                
-                // 2 => 3
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {2,0},
-                        
-                        // Test 3
-                        {-1,0},
-                        
-                        // Test 4
-                        {2,1},
-                        
-                        // Test 5
-                        {-1,-2}
-                },
-                
-                // 3 => 2
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {-2,0},
-                        
-                        // Test 3
-                        {1,0},
-                        
-                        // Test 4
-                        {-2,-1},
-                        
-                        // Test 5
-                        {1,2}
-                },
-                
-                // 3 => 0
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {1,0},
-                        
-                        // Test 3
-                        {-2,0},
-                        
-                        // Test 4
-                        {1,-2},
-                        
-                        // Test 5
-                        {-2,1}
-                },
-                
-                // 0 => 3
-                {
-                        // Test 1
-                        {0,0},
-                        
-                        // Test 2
-                        {-1,0},
-                        
-                        // Test 3
-                        {2,0},
-                        
-                        // Test 4
-                        {-1,2},
-                        
-                        // Test 5
-                        {2,-1}
-                }
+// Indexed by rotation system, piece, current rotation and direction
+static const struct kick_list rotation_kicks[3][8][4][2] = {
+        [TETRIS_ROTATION_SRS] = {
+                NO_KICKS_PIECE, SRS_I_KICKS, NO_KICKS_PIECE, SRS_JLSTZ_KICKS,
+                SRS_JLSTZ_KICKS, SRS_JLSTZ_KICKS, SRS_JLSTZ_KICKS, SRS_JLSTZ_KICKS
+        },
+        [TETRIS_ROTATION_SRS_PLUS] = {
+                NO_KICKS_PIECE, SRS_PLUS_I_KICKS, NO_KICKS_PIECE, SRS_JLSTZ_KICKS,
+                SRS_JLSTZ_KICKS, SRS_JLSTZ_KICKS, SRS_JLSTZ_KICKS, SRS_JLSTZ_KICKS
+        },
+        [TETRIS_ROTATION_ARS] = {
+                NO_KICKS_PIECE, NO_KICKS_PIECE, NO_KICKS_PIECE, ARS_KICKS,
+                ARS_KICKS, ARS_KICKS, ARS_KICKS, ARS_KICKS
         }
 };
 
 
 
-// Globals (game state)
+// Utils functions
 
-static enum tetrimino spawn_order[] = {
-        TETRIMINO_I,
-        TETRIMINO_O,
-        TETRIMINO_T,
-        TETRIMINO_S,
-        TETRIMINO_Z,
-        TETRIMINO_J,
-        TETRIMINO_L,
+// PCG32 (see pcg-random.org): a 64 bit LCG with its output scrambled by a
+// random rotation. Tiny, fast, and it passes any test we'll ever throw at it.
+static uint32_t random_next(uint64_t *state) {
+        uint64_t old = *state;
+        *state = old * 6364136223846793005ULL + 1442695040888963407ULL;
         
-        TETRIMINO_I,
-        TETRIMINO_O,
-        TETRIMINO_T,
-        TETRIMINO_S,
-        TETRIMINO_Z,
-        TETRIMINO_J,
-        TETRIMINO_L
-};
+        uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rot = (uint32_t)(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
 
-static int spawn_next_i = 0;
+static void random_seed(uint64_t *state, uint64_t seed) {
+        *state = 0;
+        random_next(state);
+        *state += seed;
+        random_next(state);
+}
 
-static long score;
-static long hiscore;
+// Uniform number in [0, range). The multiply maps the 32 random bits onto the
+// range, and the few values that would make some results more likely than
+// others are rejected (Lemire's method), so there's no modulo bias.
+static uint32_t random_below(uint64_t *state, uint32_t range) {
+        uint64_t m = (uint64_t)random_next(state) * range;
+        uint32_t low = (uint32_t)m;
+        
+        if (low < range) {
+                uint32_t threshold = -range % range;
+                while (low < threshold) {
+                        m = (uint64_t)random_next(state) * range;
+                        low = (uint32_t)m;
+                }
+        }
+        
+        return (uint32_t)(m >> 32);
+}
+
+// Fisher-Yates, every order is equally likely
+static void shuffle(struct tetris_game *g, enum tetrimino *arr, int size) {
+        for (int i=size-1; i>0; i--) {
+                int j = random_below(&g->rng_state, i+1);
+                enum tetrimino tmp = arr[i];
+                arr[i] = arr[j];
+                arr[j] = tmp;
+        }
+}
 
-static enum tetrimino current_held_piece = TETRIMINO_TEST;
 
-static enum tetris_color playfield[TETRIS_PLAYFIELD_Y][TETRIS_PLAYFIELD_X];
 
-static enum tetrimino current_piece = TETRIMINO_TEST;
-static enum tetrimino_rotation current_piece_rotation = SPAWN_ROTATED;
-static struct point current_piece_location = { 5, 20 };
+// Piece functions
 
-static struct point current_shadow_location;
+static enum tetris_color piece_color(enum tetrimino t) {
+        switch (t) {
+        case TETRIMINO_TEST:
+                return TETRIS_COLOR_PURPLE;
+        case TETRIMINO_I:
+                return TETRIS_COLOR_CYAN;
+        case TETRIMINO_O:
+                return TETRIS_COLOR_YELLOW;
+        case TETRIMINO_T:
+                return TETRIS_COLOR_PURPLE;
+        case TETRIMINO_S:
+                return TETRIS_COLOR_GREEN;
+        case TETRIMINO_Z:
+                return TETRIS_COLOR_RED;
+        case TETRIMINO_J:
+                return TETRIS_COLOR_BLUE;
+        case TETRIMINO_L:
+                return TETRIS_COLOR_ORANGE;
+        default:
+                return TETRIS_COLOR_WHITE;
+        }
+}
 
-static bool paused = false;
 
-static bool can_hold = true;
-static bool hard_dropped = false;
 
-static bool last_movement_was_spin = false;
+// Score functions
 
-static long us_until_next_step = 1000000L;
+static void add_score(struct tetris_game *g, long points) {
+        g->score += points;
+}
 
-static unsigned level = 1;
-static int goal = 5;
+static void update_score(struct tetris_game *g, long value) {
+        if (value == SOFT_DROP_SCORE || value == HARD_DROP_SCORE) {
+                add_score(g, value);
+        } else {
+                add_score(g, value * g->level);
+        }
+}
 
 
 
-// Utils functions
+// Piece generation functions
 
-static void shuffle(enum tetrimino *arr, int size) {
-        for (int i=0; i<size; i++) {
-                int j = random() % size;
-                enum tetrimino tmp = arr[i];
-                arr[i] = arr[j];
-                arr[j] = tmp;
-        }
+static void init_shuffle_pieces(struct tetris_game *g) {
+        shuffle(g, g->spawn_order, 7);
 }
 
-// ensure we don't wrte *dest beyond *n characters and at the end modify *n to
-// indicate how many characters of src we wrote. If we didn't write fully dest,
-// return false otherwise true
-static bool mystrncpy(char **dest, const char *src, size_t *n) {
-        while (*src != '\0') {
-                if (*n <= 0) {
-                        return false;
-                }
-                
-                **dest = *src;
+static enum tetrimino next_random_piece(struct tetris_game *g) {
+        if (g->spawn_next_i == 7) {
+                g->spawn_next_i = 0;
+                memcpy(g->spawn_order, g->spawn_order+7, 7*sizeof(enum tetrimino));
+        }
                 
-                (*dest)++;
-                src++;
+        if (g->spawn_next_i == 0)
+                shuffle(g, g->spawn_order+7, 7);
                 
-                (*n)--;
-        }
+        return g->spawn_order[g->spawn_next_i++];
+}
 
-        return true;
+
+
+// Playfield functions
+
+static void reset_playfield(struct tetris_game *g) {
+        for (int y=0; y<TETRIS_PLAYFIELD_Y; y++)
+                g->playfield[y] = PLAYFIELD_ROW_EMPTY;
+        for (int y=TETRIS_PLAYFIELD_Y; y<TETRIS_PLAYFIELD_Y+TETRIS_PLAYFIELD_FLOOR_ROWS; y++)
+                g->playfield[y] = PLAYFIELD_ROW_FULL;
+        memset(g->playfield_colors, 0, sizeof(g->playfield_colors));
+        g->playfield_top = TETRIS_PLAYFIELD_Y;
+        for (int x=0; x<TETRIS_PLAYFIELD_X; x++)
+                g->column_tops[x] = TETRIS_PLAYFIELD_Y;
 }
 
-static bool create_directory_if_not_exists(const char *dir) {
-        struct stat st;
+// x may be up to PLAYFIELD_ROW_SHIFT cells beyond the walls, and y up to
+// TETRIS_PLAYFIELD_FLOOR_ROWS cells below the floor
+static bool cell_occupied(const struct tetris_game *g, int x, int y) {
+        return (g->playfield[y] >> (x + PLAYFIELD_ROW_SHIFT)) & 1;
+}
+
+// Walk down column x from row y until the first block in it
+static int find_column_top(const struct tetris_game *g, int x, int y) {
+        while (y < TETRIS_PLAYFIELD_Y && !cell_occupied(g, x, y))
+                y++;
+        return y;
+}
+
+static void update_playfield_top(struct tetris_game *g) {
+        g->playfield_top = TETRIS_PLAYFIELD_Y;
+        for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
+                if (g->column_tops[x] < g->playfield_top)
+                        g->playfield_top = g->column_tops[x];
+        }
+}
+
+static void lock_piece(struct tetris_game *g, enum tetrimino piece, enum tetrimino_rotation rotation, struct point location) {
+        const struct piece_shape *shape = &piece_shapes[piece][rotation];
+        enum tetris_color color = piece_color(piece);
+        int shift = location.x + PLAYFIELD_ROW_SHIFT;
         
-        if (stat(dir, &st) == -1) {
-                if (mkdir(dir, 0700) == -1) {
-                        perror(dir);
-                        return false;
+        if (location.y + shape->top < g->playfield_top)
+                g->playfield_top = location.y + shape->top;
+        for (int i=shape->left; i<=shape->right; i++) {
+                int top = location.y + shape->column_tops[i];
+                if (shape->column_tops[i] >= 0 && top < g->column_tops[location.x + i])
+                        g->column_tops[location.x + i] = top;
+        }
+        
+        for (int j=shape->top; j<=shape->bottom; j++) {
+                int y = location.y + j;
+                g->playfield[y] |= (uint32_t)shape->rows[j] << shift;
+                for (int i=shape->left; i<=shape->right; i++) {
+                        if ((shape->rows[j] >> i) & 1)
+                                g->playfield_colors[y][location.x + i] = color;
                 }
         }
+}
 
-        return true;
+
+
+// Gameplay functions
+
+static uint32_t get_gravity(const struct tetris_game *g) {
+        if (g->level >= GRAVITY_LEVELS)
+                return gravity_table[GRAVITY_LEVELS - 1];
+        return gravity_table[g->level - 1];
 }
 
-static bool make_directory_exist(const char *filename) {
-        char *directory = strdup(filename);
+static void update_level(struct tetris_game *g, int lines_score) {
+        g->goal -= lines_score;
+        while (g->goal <= 0) {
+                g->goal += g->level * 5;
+                g->level++;
+                TRACE_INSTANT(TRACE_LEVEL_UP);
+        }
+}
+
+static bool collision(const struct tetris_game *g, enum tetrimino piece, enum tetrimino_rotation rotation, struct point location) {
+        // Beyond these the piece is out of the playfield no matter its shape,
+        // and the masks below would not fit in the row words. Pieces never
+        // get near the top of the buffer zone, so y < 0 is simply refused.
+        if (location.x < -PLAYFIELD_ROW_SHIFT || location.x > TETRIS_PLAYFIELD_X)
+                return true;
+        if (location.y < 0 || location.y > TETRIS_PLAYFIELD_Y)
+                return true;
+
+        const struct piece_shape *shape = &piece_shapes[piece][rotation];
+        const uint32_t *rows = g->playfield + location.y;
+        int shift = location.x + PLAYFIELD_ROW_SHIFT;
         
-        size_t i = 0;
-        for (;;) {
-                while (directory[i] != '/' && directory[i] != '\0') {
-                        i++;
-                }
+        return ((rows[0] & (uint32_t)shape->rows[0] << shift) |
+                (rows[1] & (uint32_t)shape->rows[1] << shift) |
+                (rows[2] & (uint32_t)shape->rows[2] << shift) |
+                (rows[3] & (uint32_t)shape->rows[3] << shift)) != 0;
+}
+
+// How many rows the piece can fall from location, or -1 if it collides
+// already. As long as the piece is above the surface on every column it
+// covers, this comes straight from its bottom profile and the column tops.
+// Otherwise it's tucked under an overhang and we have to probe row by row.
+static int drop_distance(const struct tetris_game *g, enum tetrimino piece, enum tetrimino_rotation rotation, struct point location) {
+        const struct piece_shape *shape = &piece_shapes[piece][rotation];
+        
+        int distance = TETRIS_PLAYFIELD_Y;
+        for (int i=shape->left; i<=shape->right; i++) {
+                if (shape->column_bottoms[i] < 0)
+                        continue;
                 
-                if (directory[i] == '\0' || directory[i+1] == '\0') {
+                int d = g->column_tops[location.x + i] - (location.y + shape->column_bottoms[i]) - 1;
+                if (d < 0) {
+                        distance = -1;
                         break;
                 }
+                if (d < distance)
+                        distance = d;
+        }
+
+        if (distance < 0) {
+                if (collision(g, piece, rotation, location))
+                        return -1;
                 
-                i++;
-                char c = directory[i];
-                directory[i] = '\0';
-                if (!create_directory_if_not_exists(directory)) {
-                        return false;
+                distance = 0;
+                location.y++;
+                while (!collision(g, piece, rotation, location)) {
+                        distance++;
+                        location.y++;
                 }
-                directory[i] = c;
         }
         
-        free(directory);
-        return true;
+        return distance;
 }
 
-static void endwin_wrapper(void) {
-        endwin();
+static void update_shadow_location(struct tetris_game *g) {
+        g->current_shadow_location = g->current_piece_location;
+        g->current_shadow_location.y += drop_distance(g, g->current_piece, g->current_piece_rotation, g->current_piece_location);
 }
 
+// Only rows from top to bottom (at most four of them, which is all a piece
+// can fill) are checked for being full. The rows above the lowest full one
+// are then compacted downwards in a single pass that stops at the top of
+// the stack, since everything above it is empty anyway.
+static int clear_full_lines(struct tetris_game *g, int top, int bottom) {
+        g->last_line_clear.count = 0;
+        for (int y=bottom; y>=top; y--) {
+                if (g->playfield[y] == PLAYFIELD_ROW_FULL)
+                        g->last_line_clear.rows[g->last_line_clear.count++] = y;
+        }
 
+        if (g->last_line_clear.count == 0)
+                return 0;
 
-// Colors functions
+        int dst = g->last_line_clear.rows[0];
+        for (int src=dst-1; src>=g->playfield_top; src--) {
+                if (src >= top && g->playfield[src] == PLAYFIELD_ROW_FULL)
+                        continue;
+                
+                g->playfield[dst] = g->playfield[src];
+                memcpy(g->playfield_colors[dst], g->playfield_colors[src], sizeof(g->playfield_colors[0]));
+                dst--;
+        }
+        for (; dst>=g->playfield_top; dst--) {
+                g->playfield[dst] = PLAYFIELD_ROW_EMPTY;
+                memset(g->playfield_colors[dst], 0, sizeof(g->playfield_colors[0]));
+        }
 
-static void setup_colors(void) {
-        start_color();
+        // Every column reaches at least as high as any full row, so each
+        // column's block has either moved down or been cleared: look for
+        // the new top starting from the old one.
+        for (int x=0; x<TETRIS_PLAYFIELD_X; x++)
+                g->column_tops[x] = find_column_top(g, x, g->column_tops[x]);
+        update_playfield_top(g);
         
-        init_pair(1, COLOR_CYAN, COLOR_CYAN);
-        init_pair(2, COLOR_YELLOW, COLOR_YELLOW);
-        init_pair(3, COLOR_MAGENTA, COLOR_MAGENTA);
-        init_pair(4, COLOR_GREEN, COLOR_GREEN);
-        init_pair(5, COLOR_RED, COLOR_RED);
-        init_pair(6, COLOR_BLUE, COLOR_BLUE);
-        init_pair(7, COLOR_YELLOW, COLOR_YELLOW); // This should be orange, but we don't have this color.
-        
-        init_pair(8, COLOR_BLACK, COLOR_BLACK);
-        init_pair(9, COLOR_WHITE, COLOR_WHITE);
-        
-        init_pair(10, COLOR_CYAN, COLOR_BLACK);
-        init_pair(11, COLOR_YELLOW, COLOR_BLACK);
-        init_pair(12, COLOR_MAGENTA, COLOR_BLACK);
-        init_pair(13, COLOR_GREEN, COLOR_BLACK);
-        init_pair(14, COLOR_RED, COLOR_BLACK);
-        init_pair(15, COLOR_BLUE, COLOR_BLACK);
-        init_pair(16, COLOR_YELLOW, COLOR_BLACK); // This should be orange, but we don't have this color.
-}
-
-static void enable_color(enum tetris_color c, bool shadow) {
-        int add;
-        if (shadow)
-                add = 9;
-        else
-                add = 0;
+        return g->last_line_clear.count;
+}
+
+static void step(struct tetris_game *g) {
+        if (g->paused)
+                return;
         
-        switch (c) {
-        case TETRIS_COLOR_CYAN:
-                attron(COLOR_PAIR(1 + add)); break;
-        case TETRIS_COLOR_YELLOW:
-                attron(COLOR_PAIR(2 + add)); break;
-        case TETRIS_COLOR_PURPLE:
-                attron(COLOR_PAIR(3 + add)); break;
-        case TETRIS_COLOR_GREEN:
-                attron(COLOR_PAIR(4 + add)); break;
-        case TETRIS_COLOR_RED:
-                attron(COLOR_PAIR(5 + add)); break;
-        case TETRIS_COLOR_BLUE:
-                attron(COLOR_PAIR(6 + add)); break;
-        case TETRIS_COLOR_ORANGE:
-                attron(COLOR_PAIR(7 + add)); break;
-        case TETRIS_COLOR_BLACK:
-                attron(COLOR_PAIR(8 + add)); break;
-        case TETRIS_COLOR_WHITE:
-                attron(COLOR_PAIR(9 + add)); break;
-        }
-}
+        uint32_t gravity = get_gravity(g);
+        g->gravity_progress += gravity;
+        int rows = g->gravity_progress >> 16;
+        g->gravity_progress &= GRAVITY_ONE_ROW - 1;
+        if (rows == 0)
+                return;
 
-static void disable_color(enum tetris_color c, bool shadow) {
-        int add;
-        if (shadow)
-                add = 9;
-        else
-                add = 0;
+        // The shadow is always kept up to date from the surface, so it tells
+        // how far the piece can fall without probing any rows
+        int distance = g->current_shadow_location.y - g->current_piece_location.y;
+        if (gravity >= GRAVITY_20G || rows > distance)
+                rows = distance;
         
-        switch (c) {
-        case TETRIS_COLOR_CYAN:
-                attroff(COLOR_PAIR(1 + add)); break;
-        case TETRIS_COLOR_YELLOW:
-                attroff(COLOR_PAIR(2 + add)); break;
-        case TETRIS_COLOR_PURPLE:
-                attroff(COLOR_PAIR(3 + add)); break;
-        case TETRIS_COLOR_GREEN:
-                attroff(COLOR_PAIR(4 + add)); break;
-        case TETRIS_COLOR_RED:
-                attroff(COLOR_PAIR(5 + add)); break;
-        case TETRIS_COLOR_BLUE:
-                attroff(COLOR_PAIR(6 + add)); break;
-        case TETRIS_COLOR_ORANGE:
-                attroff(COLOR_PAIR(7 + add)); break;
-        case TETRIS_COLOR_BLACK:
-                attroff(COLOR_PAIR(8 + add)); break;
-        case TETRIS_COLOR_WHITE:
-                attroff(COLOR_PAIR(9 + add)); break;
+        if (distance > 0) {
+                g->current_piece_location.y += rows;
+                return;
+        }
+
+        // A piece that is already resting locks on the next row it would fall
+        g->hard_dropped = false;
+
+        // Detect T-spin
+        if (g->current_piece == TETRIMINO_T && g->last_movement_was_spin) {
+                // Corners are looked up one row below the piece, where the
+                // step that locked it tried to move it
+                int x = g->current_piece_location.x;
+                int y = g->current_piece_location.y + 1;
+
+                int count = cell_occupied(g, x, y) + cell_occupied(g, x+2, y) +
+                        cell_occupied(g, x+2, y+2) + cell_occupied(g, x, y+2);
+
+                if (count >= 3)
+                        update_score(g, T_SPIN_SCORE);
+        }
+        g->last_movement_was_spin = false;
+
+        // Add piece to playfield
+        const struct piece_shape *shape = &piece_shapes[g->current_piece][g->current_piece_rotation];
+        lock_piece(g, g->current_piece, g->current_piece_rotation, g->current_piece_location);
+        TRACE_INSTANT(TRACE_LOCK);
+
+        TRACE_BEGIN(TRACE_CLEAR_LINES);
+        int full_lines_count = clear_full_lines(g, g->current_piece_location.y + shape->top,
+                                                g->current_piece_location.y + shape->bottom);
+        TRACE_END(TRACE_CLEAR_LINES);
+        if (full_lines_count > 0)
+                TRACE_INSTANT(TRACE_LINE_CLEAR);
+        g->lines += full_lines_count;
+        switch (full_lines_count) {
+        case 1:
+                update_score(g, SINGLE_SCORE);
+                update_level(g, SINGLE_LEVEL_SCORE);
+                break;
+        case 2:
+                update_score(g, DOUBLE_SCORE);
+                update_level(g, DOUBLE_LEVEL_SCORE);
+                break;
+        case 3:
+                update_score(g, TRIPLE_SCORE);
+                update_level(g, TRIPLE_LEVEL_SCORE);
+                break;
+        case 4:
+                update_score(g, TETRIS_SCORE);
+                update_level(g, TETRIS_LEVEL_SCORE);
+                break;
         }
+        
+        g->current_piece = next_random_piece(g);
+        g->current_piece_rotation = SPAWN_ROTATED;
+        g->current_piece_location.x = 5;
+        g->current_piece_location.y = 20;
+        g->can_hold = true;
+        update_shadow_location(g);
+
+        // The shadow is only above the piece when it doesn't fit where it spawned
+        if (g->current_shadow_location.y < g->current_piece_location.y)
+                g->game_over = true;
 }
 
-static enum tetris_color piece_color(enum tetrimino t) {
-        switch (t) {
-        case TETRIMINO_TEST:
-                return TETRIS_COLOR_PURPLE;
-        case TETRIMINO_I:
-                return TETRIS_COLOR_CYAN;
-        case TETRIMINO_O:
-                return TETRIS_COLOR_YELLOW;
-        case TETRIMINO_T:
-                return TETRIS_COLOR_PURPLE;
-        case TETRIMINO_S:
-                return TETRIS_COLOR_GREEN;
-        case TETRIMINO_Z:
-                return TETRIS_COLOR_RED;
-        case TETRIMINO_J:
-                return TETRIS_COLOR_BLUE;
-        case TETRIMINO_L:
-                return TETRIS_COLOR_ORANGE;
-        default:
-                return TETRIS_COLOR_WHITE;
+static bool rotate(struct tetris_game *g, enum rotation_direction direction) {
+        const struct kick_list *kicks = &rotation_kicks[g->rotation_system][g->current_piece][g->current_piece_rotation][direction];
+        enum tetrimino_rotation next = (g->current_piece_rotation + (direction == ROTATE_CLOCKWISE ? 1 : 3)) % 4;
+
+        for (int k=0; k<kicks->count; k++) {
+                struct point location = {
+                        g->current_piece_location.x + kicks->tests[k].x,
+                        g->current_piece_location.y + kicks->tests[k].y
+                };
+                
+                if (!collision(g, g->current_piece, next, location)) {
+                        g->current_piece_rotation = next;
+                        g->current_piece_location = location;
+                        return true;
+                }
         }
+
+        return false;
 }
 
 
 
-// Drawing functions
+// Game functions
 
-static void decide_rotation_offset_draw_tetrimino(enum tetrimino t,
-                                                  enum tetrimino_rotation *r, struct point *o) {
-        switch(t) {
-        case TETRIMINO_TEST:
-                *r = SPAWN_ROTATED;
-                o->x = 0;
-                o->y = 0;
-                break;
-        case TETRIMINO_I:
-                *r = SPAWN_ROTATED;
-                o->x = -2;
-                o->y = 1;
+void tetris_game_init(struct tetris_game *g, uint64_t seed) {
+        static const enum tetrimino bag[7] = {
+                TETRIMINO_I,
+                TETRIMINO_O,
+                TETRIMINO_T,
+                TETRIMINO_S,
+                TETRIMINO_Z,
+                TETRIMINO_J,
+                TETRIMINO_L
+        };
+        
+        memset(g, 0, sizeof(*g));
+        reset_playfield(g);
+
+        random_seed(&g->rng_state, seed);
+        memcpy(g->spawn_order, bag, sizeof(bag));
+        memcpy(g->spawn_order+7, bag, sizeof(bag));
+        init_shuffle_pieces(g);
+
+        g->current_held_piece = TETRIMINO_TEST;
+        g->can_hold = true;
+        g->level = 1;
+        g->goal = 5;
+
+        g->current_piece = next_random_piece(g);
+        g->current_piece_rotation = SPAWN_ROTATED;
+        g->current_piece_location.x = 5;
+        g->current_piece_location.y = 20;
+        update_shadow_location(g);
+}
+
+bool tetris_game_input(struct tetris_game *g, enum input_type input) {
+        if (g->game_over)
+                return false;
+        
+        if (input == INPUT_PAUSE) {
+                g->paused = !g->paused;
+                return true;
+        }
+
+        if (g->paused || g->hard_dropped)
+                return false;
+
+        switch(input) {
+        case INPUT_CLOCKWISE_ROTATION:
+                if (!rotate(g, ROTATE_CLOCKWISE))
+                        return false;
+                g->last_movement_was_spin = true;
+                //g->us_until_next_step = STEP_TIME_US;
+                update_shadow_location(g);
                 break;
-        case TETRIMINO_O:
-                *r = SPAWN_ROTATED;
-                o->x = -2;
-                o->y = 1;
+        
+        case INPUT_HARD_DROP:
+                add_score(g, HARD_DROP_SCORE * (g->current_shadow_location.y - g->current_piece_location.y + 1));
+                g->current_piece_location.y = g->current_shadow_location.y;
+                g->gravity_progress = 0;
+                g->hard_dropped = true;
                 break;
-        case TETRIMINO_T:
-                *r = SPAWN_ROTATED;
-                o->x = -1;
-                o->y = 1;
+        
+        case INPUT_HOLD:
+                if (!g->can_hold)
+                        return false;
+                enum tetrimino held = g->current_held_piece;
+                g->current_held_piece = g->current_piece;
+                if (held == TETRIMINO_TEST)
+                        g->current_piece = next_random_piece(g);
+                else
+                        g->current_piece = held;
+                g->current_piece_rotation = SPAWN_ROTATED;
+                g->current_piece_location.x = 5;
+                g->current_piece_location.y = 20;
+                g->gravity_progress = 0;
+                g->can_hold = false;
+                g->last_movement_was_spin = false;
+                update_shadow_location(g);
+                TRACE_INSTANT(TRACE_HOLD);
                 break;
-        case TETRIMINO_S:
-                *r = SPAWN_ROTATED;
-                o->x = -1;
-                o->y = 1;
+        
+        case INPUT_COUNTERCLOCKWISE_ROTATION:
+                if (!rotate(g, ROTATE_COUNTERCLOCKWISE))
+                        return false;
+                g->last_movement_was_spin = true;
+                //g->gravity_progress = 0;
+                update_shadow_location(g);
                 break;
-        case TETRIMINO_Z:
-                *r = SPAWN_ROTATED;
-                o->x = -1;
-                o->y = 1;
+        
+        case INPUT_SOFT_DROP:
+                g->current_piece_location.y += 1;
+                if (collision(g, g->current_piece, g->current_piece_rotation, g->current_piece_location)) {
+                        g->current_piece_location.y -= 1;
+                        return false;
+                }
+                update_score(g, SOFT_DROP_SCORE);
+                g->gravity_progress = 0;
                 break;
-        case TETRIMINO_J:
-                *r = SPAWN_ROTATED;
-                o->x = -1;
-                o->y = 1;
+        
+        case INPUT_LEFT:
+                g->current_piece_location.x -= 1;
+                if (collision(g, g->current_piece, g->current_piece_rotation, g->current_piece_location)) {
+                        g->current_piece_location.x += 1;
+                        return false;
+                }
+                //g->gravity_progress = 0;
+                update_shadow_location(g);
                 break;
-        case TETRIMINO_L:
-                *r = SPAWN_ROTATED;
-                o->x = -1;
-                o->y = 1;
+        
+        case INPUT_RIGHT:
+                g->current_piece_location.x += 1;
+                if (collision(g, g->current_piece, g->current_piece_rotation, g->current_piece_location)) {
+                        g->current_piece_location.x -= 1;
+                        return false;
+                }
+                //g->gravity_progress = 0;
+                update_shadow_location(g);
                 break;
+        
+        default:
+                return false;
         }
+
+        return true;
 }
 
-static void draw(struct point st, struct point ed, enum tetris_color c) {
-        enable_color(c, false);
-        for (int x=st.x; x<ed.x; x++) {
-                for (int y=st.y; y<ed.y; y++) {
-                        mvaddch(y, x, DRAWING_CHAR);
+void tetris_game_tick(struct tetris_game *g) {
+        if (g->game_over)
+                return;
+        
+        step(g);
+}
+
+void tetris_game_set_rotation_system(struct tetris_game *g, enum tetris_rotation_system system) {
+        g->rotation_system = system;
+}
+
+bool tetris_game_is_over(const struct tetris_game *g) {
+        return g->game_over;
+}
+
+static bool is_piece(enum tetrimino t) {
+        return (int)t >= TETRIMINO_I && (int)t <= TETRIMINO_L;
+}
+
+bool tetris_game_is_valid(const struct tetris_game *g) {
+        for (int i=0; i<14; i++)
+                if (!is_piece(g->spawn_order[i]))
+                        return false;
+        if (g->spawn_next_i < 0 || g->spawn_next_i > 7)
+                return false;
+        if (!is_piece(g->current_piece) || (int)g->current_piece_rotation < SPAWN_ROTATED ||
+            (int)g->current_piece_rotation > COUNTER_ROTATED)
+                return false;
+        if (g->current_held_piece != TETRIMINO_TEST && !is_piece(g->current_held_piece))
+                return false;
+        if ((int)g->rotation_system < TETRIS_ROTATION_SRS || (int)g->rotation_system > TETRIS_ROTATION_ARS)
+                return false;
+        if (g->level < 1 || g->last_line_clear.count < 0 || g->last_line_clear.count > 4)
+                return false;
+        for (int i=0; i<g->last_line_clear.count; i++)
+                if (g->last_line_clear.rows[i] < 0 || g->last_line_clear.rows[i] >= TETRIS_PLAYFIELD_Y)
+                        return false;
+
+        // The walls and floor are there, and the tops are where they'd be found
+        for (int y=0; y<TETRIS_PLAYFIELD_Y; y++)
+                if ((g->playfield[y] & PLAYFIELD_ROW_EMPTY) != PLAYFIELD_ROW_EMPTY)
+                        return false;
+        for (int y=TETRIS_PLAYFIELD_Y; y<TETRIS_PLAYFIELD_Y+TETRIS_PLAYFIELD_FLOOR_ROWS; y++)
+                if (g->playfield[y] != PLAYFIELD_ROW_FULL)
+                        return false;
+        for (int y=0; y<TETRIS_PLAYFIELD_Y; y++)
+                for (int x=0; x<TETRIS_PLAYFIELD_X; x++)
+                        if ((int)g->playfield_colors[y][x] < TETRIS_COLOR_BLACK ||
+                            (int)g->playfield_colors[y][x] > TETRIS_COLOR_WHITE)
+                                return false;
+        int top = TETRIS_PLAYFIELD_Y;
+        for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
+                if (g->column_tops[x] != find_column_top(g, x, 0))
+                        return false;
+                if (g->column_tops[x] < top)
+                        top = g->column_tops[x];
+        }
+        if (g->playfield_top != top)
+                return false;
+        
+        // Over games are left with the piece that didn't fit
+        if (g->game_over)
+                return true;
+        if (collision(g, g->current_piece, g->current_piece_rotation, g->current_piece_location))
+                return false;
+        struct point shadow = g->current_piece_location;
+        shadow.y += drop_distance(g, g->current_piece, g->current_piece_rotation, g->current_piece_location);
+        return shadow.x == g->current_shadow_location.x && shadow.y == g->current_shadow_location.y;
+}
+
+enum tetris_color tetris_game_cell(const struct tetris_game *g, int x, int y) {
+        return g->playfield_colors[y][x];
+}
+
+enum tetrimino tetris_game_next_piece(const struct tetris_game *g, int n) {
+        return g->spawn_order[g->spawn_next_i + n];
+}
+
+enum tetris_color tetris_piece_color(enum tetrimino t) {
+        return piece_color(t);
+}
+
+bool tetris_piece_cell(enum tetrimino t, enum tetrimino_rotation r, int x, int y) {
+        return (piece_shapes[t][r].rows[y] >> x) & 1;
+}
+
+
+
+#ifdef RNG_HARNESS
+
+// RNG harness
+//
+// Deals a lot of bags on every core and checks that each piece is as likely
+// in every position of the bag, and that all 5040 bag orders are as likely.
+
+#define RNG_HARNESS_DEFAULT_BAGS 1000000000ULL
+#define RNG_HARNESS_MAX_THREADS 256
+#define RNG_HARNESS_ORDERS 5040
+
+struct rng_worker {
+        pthread_t thread;
+        uint64_t seed;
+        uint64_t bags;
+        uint64_t positions[7][8];
+        uint64_t orders[RNG_HARNESS_ORDERS];
+};
+
+// Index of the order of a bag among all 5040 of them (its Lehmer code)
+static int bag_order_index(const enum tetrimino *bag) {
+        int index = 0;
+        for (int i=0; i<7; i++) {
+                int smaller = 0;
+                for (int j=i+1; j<7; j++)
+                        if (bag[j] < bag[i])
+                                smaller++;
+                index = index * (7-i) + smaller;
+        }
+        return index;
+}
+
+static void *rng_worker_run(void *arg) {
+        struct rng_worker *w = arg;
+        struct tetris_game g;
+        tetris_game_init(&g, w->seed);
+
+        enum tetrimino bag[7];
+        memcpy(bag, g.spawn_order, sizeof(bag));
+        for (uint64_t n=0; n<w->bags; n++) {
+                shuffle(&g, bag, 7);
+                for (int i=0; i<7; i++)
+                        w->positions[i][bag[i]]++;
+                w->orders[bag_order_index(bag)]++;
+        }
+
+        return NULL;
+}
+
+// Wilson-Hilferty: how many standard deviations a chi-square statistic is
+// away from what df degrees of freedom would give on average
+static double chi_square_z(double chi2, int df) {
+        double v = 2.0 / (9.0 * df);
+        return (cbrt(chi2 / df) - (1.0 - v)) / sqrt(v);
+}
+
+static double rng_harness_seconds(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+        uint64_t bags = RNG_HARNESS_DEFAULT_BAGS;
+        uint64_t seed = 1;
+        if (argc > 1)
+                bags = strtoull(argv[1], NULL, 10);
+        if (argc > 2)
+                seed = strtoull(argv[2], NULL, 10);
+        if (bags == 0) {
+                fprintf(stderr, "usage: %s [bags [seed]]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads < 1)
+                threads = 1;
+        if (threads > RNG_HARNESS_MAX_THREADS)
+                threads = RNG_HARNESS_MAX_THREADS;
+
+        struct rng_worker *workers = calloc(threads, sizeof(*workers));
+        if (workers == NULL) {
+                perror("calloc");
+                return EXIT_FAILURE;
+        }
+
+        double start = rng_harness_seconds();
+        for (long t=0; t<threads; t++) {
+                workers[t].seed = seed + t * 0x9E3779B97F4A7C15ULL;
+                workers[t].bags = bags / threads + ((uint64_t)t < bags % threads);
+                if (pthread_create(&workers[t].thread, NULL, rng_worker_run, &workers[t]) != 0) {
+                        perror("pthread_create");
+                        return EXIT_FAILURE;
+                }
+        }
+        for (long t=0; t<threads; t++)
+                pthread_join(workers[t].thread, NULL);
+        double elapsed = rng_harness_seconds() - start;
+
+        static uint64_t positions[7][8];
+        static uint64_t orders[RNG_HARNESS_ORDERS];
+        for (long t=0; t<threads; t++) {
+                for (int i=0; i<7; i++)
+                        for (int p=TETRIMINO_I; p<=TETRIMINO_L; p++)
+                                positions[i][p] += workers[t].positions[i][p];
+                for (int o=0; o<RNG_HARNESS_ORDERS; o++)
+                        orders[o] += workers[t].orders[o];
+        }
+        free(workers);
+
+        double expected = bags / 7.0;
+        double position_chi2 = 0, max_deviation = 0;
+        for (int i=0; i<7; i++) {
+                for (int p=TETRIMINO_I; p<=TETRIMINO_L; p++) {
+                        double d = positions[i][p] - expected;
+                        position_chi2 += d * d / expected;
+                        if (fabs(d) / expected > max_deviation)
+                                max_deviation = fabs(d) / expected;
                 }
         }
-        disable_color(c, false);
+        int position_df = 7 * 6;
+
+        expected = bags / (double)RNG_HARNESS_ORDERS;
+        double order_chi2 = 0;
+        uint64_t order_min = UINT64_MAX, order_max = 0;
+        for (int o=0; o<RNG_HARNESS_ORDERS; o++) {
+                double d = orders[o] - expected;
+                order_chi2 += d * d / expected;
+                if (orders[o] < order_min)
+                        order_min = orders[o];
+                if (orders[o] > order_max)
+                        order_max = orders[o];
+        }
+        int order_df = RNG_HARNESS_ORDERS - 1;
+
+        double position_z = chi_square_z(position_chi2, position_df);
+        double order_z = chi_square_z(order_chi2, order_df);
+        printf("bags: %llu on %ld threads in %.2f s (%.1f M bags/s), seed %llu\n",
+               (unsigned long long)bags, threads, elapsed, bags / elapsed / 1e6,
+               (unsigned long long)seed);
+        printf("positions: chi2 %.2f, df %d, z %+.2f, max deviation %.4f%%\n",
+               position_chi2, position_df, position_z, max_deviation * 100);
+        printf("orders: chi2 %.2f, df %d, z %+.2f, min %llu, max %llu\n",
+               order_chi2, order_df, order_z,
+               (unsigned long long)order_min, (unsigned long long)order_max);
+
+        // Anything beyond 5 standard deviations is not bad luck
+        if (fabs(position_z) > 5 || fabs(order_z) > 5) {
+                printf("FAIL\n");
+                return EXIT_FAILURE;
+        }
+        printf("OK\n");
+        return EXIT_SUCCESS;
 }
 
-static void draw_tetrimino(enum tetrimino t, struct point c) {
-        enable_color(piece_color(t), false);
-        
-        enum tetrimino_rotation r = SPAWN_ROTATED;
-        struct point o = {0, 0};
-        decide_rotation_offset_draw_tetrimino(t, &r, &o);
+#endif /* RNG_HARNESS */
+
+
+
+#ifdef BENCH
+
+// Benchmarks
+//
+// Times the engine hot paths on a fixed corpus of boards, stacked by playing
+// random moves from fixed seeds. Every benchmark is warmed up, then repeated
+// and the median is kept. A table goes to stderr and JSON to stdout.
+
+#define BENCH_BOARDS 16
+#define BENCH_REPETITIONS 9
+#define BENCH_WARMUP_NS 20000000ULL
+#define BENCH_REPETITION_NS 50000000ULL
+
+struct bench_result {
+        const char *name;
+        uint64_t iterations;
+        double ns_per_op[BENCH_REPETITIONS];
+        double median_ns_per_op;
+        double min_ns_per_op;
+};
+
+struct bench {
+        const char *name;
+        uint64_t (*run)(uint64_t iterations);
+};
+
+static struct tetris_game bench_boards[BENCH_BOARDS];
+
+// Same boards with their lowest four rows made full, to have something to clear
+static struct tetris_game bench_full_boards[BENCH_BOARDS];
+
+// What the benchmarks that move the piece around play with, reset before every run
+static struct tetris_game bench_work_boards[BENCH_BOARDS];
+
+// Keeps the compiler from throwing away what the benchmarks compute
+static volatile uint64_t bench_sink;
+
+static uint64_t bench_now_ns(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Drop random pieces at random places until the stack is height rows high
+static void bench_make_board(struct tetris_game *g, uint64_t seed, int height) {
+        uint64_t rng;
+        random_seed(&rng, seed);
+        tetris_game_init(g, seed);
         
-        for (int j=0; j<4; j++) {
-                for (int i=0; i<4; i++) {
-                        if (piece_shapes[t][r][j][i]) {
-                                mvaddch(c.y+j+o.y, c.x+i*2+o.x, DRAWING_CHAR);
-                                mvaddch(c.y+j+o.y, c.x+i*2+1+o.x, DRAWING_CHAR);
-                        }
-                        
+        while (TETRIS_PLAYFIELD_Y - g->playfield_top < height) {
+                int turns = random_below(&rng, 4);
+                int shift = (int)random_below(&rng, 11) - 5;
+                for (int i=0; i<turns; i++)
+                        tetris_game_input(g, INPUT_CLOCKWISE_ROTATION);
+                for (int i=0; i<abs(shift); i++)
+                        tetris_game_input(g, shift < 0 ? INPUT_LEFT : INPUT_RIGHT);
+                tetris_game_input(g, INPUT_HARD_DROP);
+                while (g->hard_dropped)
+                        tetris_game_tick(g);
+                
+                if (g->game_over)
+                        tetris_game_init(g, ++seed);
+        }
+}
+
+static void bench_make_corpus(void) {
+        for (int i=0; i<BENCH_BOARDS; i++) {
+                struct tetris_game *g = &bench_boards[i];
+                bench_make_board(g, 1000 + i, 4 + i % 12);
+                g->current_piece_location = (struct point){3, 20};
+                update_shadow_location(g);
+
+                struct tetris_game *full = &bench_full_boards[i];
+                *full = *g;
+                for (int y=TETRIS_PLAYFIELD_Y-4; y<TETRIS_PLAYFIELD_Y; y++) {
+                        full->playfield[y] = PLAYFIELD_ROW_FULL;
+                        for (int x=0; x<TETRIS_PLAYFIELD_X; x++)
+                                if (full->playfield_colors[y][x] == TETRIS_COLOR_BLACK)
+                                        full->playfield_colors[y][x] = TETRIS_COLOR_WHITE;
                 }
         }
+}
 
-        disable_color(piece_color(t), false);
+static uint64_t bench_collision(uint64_t iterations) {
+        uint64_t hits = 0;
+        for (uint64_t n=0; n<iterations; n++) {
+                const struct tetris_game *g = &bench_boards[n % BENCH_BOARDS];
+                struct point location = {(int)(n % 11) - 2, 20 + (int)(n % 19)};
+                hits += collision(g, TETRIMINO_I + n % 7, (n / 7) % 4, location);
+        }
+        return hits;
 }
 
-static void draw_background(struct point max) {
-        draw((struct point){0, 0}, max, TETRIS_COLOR_WHITE);
+static uint64_t bench_rotate(uint64_t iterations) {
+        uint64_t rotated = 0;
+        for (uint64_t n=0; n<iterations; n++) {
+                struct tetris_game *g = &bench_work_boards[n % BENCH_BOARDS];
+                rotated += rotate(g, (n / BENCH_BOARDS) % 8 < 4 ? ROTATE_CLOCKWISE : ROTATE_COUNTERCLOCKWISE);
+        }
+        return rotated;
 }
 
-static void draw_playfield(struct point st, struct point ed) {
-        if (paused) {
-                struct point bst;
-                bst.x = st.x;
-                bst.y = st.y + TETRIS_PLAYFIELD_Y/2;
-                draw(bst, ed, TETRIS_COLOR_BLACK);
-                
-                const char text[] = "PAUSED";
-                const unsigned textlen = sizeof(text);
-                int x = st.x + (ed.x - st.x)/2 - textlen/2;
-                int y = st.y + 3*(ed.y - st.y)/4;
-                mvprintw(y, x, text);
-                return;
+static uint64_t bench_update_shadow_location(uint64_t iterations) {
+        uint64_t rows = 0;
+        for (uint64_t n=0; n<iterations; n++) {
+                struct tetris_game *g = &bench_work_boards[n % BENCH_BOARDS];
+                g->current_piece_location.x = (n / BENCH_BOARDS) % 7;
+                update_shadow_location(g);
+                rows += g->current_shadow_location.y;
         }
-        
-        for (int j=TETRIS_PLAYFIELD_Y/2; j<TETRIS_PLAYFIELD_Y; j++) {
-                for (int i=0; i<TETRIS_PLAYFIELD_X; i++) {
-                        struct point c;
-                        c.x = i - current_piece_location.x;
-                        c.y = j - current_piece_location.y;
+        return rows;
+}
 
-                        struct point s;
-                        s.x = i - current_shadow_location.x;
-                        s.y = j - current_shadow_location.y;
+static uint64_t bench_next_random_piece(uint64_t iterations) {
+        uint64_t pieces = 0;
+        struct tetris_game *g = &bench_work_boards[0];
+        for (uint64_t n=0; n<iterations; n++)
+                pieces += next_random_piece(g);
+        return pieces;
+}
 
-                        bool piece_in_range = (c.x >= 0 && c.x < 4 && c.y >= 0 && c.y < 4);
-                        bool shadow_in_range = (s.x >= 0 && s.x < 4 && s.y >= 0 && s.y < 4);
-                        
-                        enum tetris_color color;
-                        bool shadow;
-                        if (piece_in_range && piece_shapes[current_piece][current_piece_rotation][c.y][c.x]) {
-                                color = piece_color(current_piece);
-                                shadow = false;
-                        } else if (shadow_in_range && piece_shapes[current_piece][current_piece_rotation][s.y][s.x]) {
-                                color = piece_color(current_piece);
-                                shadow = true;
-                        } else {
-                                color = playfield[j][i];
-                                shadow = false;
-                        }
-                        
-                        enable_color(color, shadow);
-                        mvaddch(st.y+j, st.x+i*2, DRAWING_CHAR);
-                        mvaddch(st.y+j, st.x+i*2+1, DRAWING_CHAR);
-                        disable_color(color, shadow);
-                }
+// This and the lock cycle include copying a board, as both change it
+static uint64_t bench_clear_full_lines(uint64_t iterations) {
+        uint64_t lines = 0;
+        struct tetris_game g;
+        for (uint64_t n=0; n<iterations; n++) {
+                g = bench_full_boards[n % BENCH_BOARDS];
+                lines += clear_full_lines(&g, TETRIS_PLAYFIELD_Y-4, TETRIS_PLAYFIELD_Y-1);
         }
+        return lines;
 }
 
-static void draw_nextarea(struct point st, struct point ed) {
-        draw(st, ed, TETRIS_COLOR_BLACK);
-        mvprintw(st.y+0, st.x+1, "Next");
+// A resting piece locking: lock, line clears, scoring and the next spawn
+static uint64_t bench_lock_cycle(uint64_t iterations) {
+        uint64_t score = 0;
+        struct tetris_game g;
+        for (uint64_t n=0; n<iterations; n++) {
+                g = bench_boards[n % BENCH_BOARDS];
+                g.current_piece_location.y = g.current_shadow_location.y;
+                g.gravity_progress = GRAVITY_ONE_ROW - 1;
+                step(&g);
+                score += g.score + g.playfield_top;
+        }
+        return score;
+}
 
-        if (paused) {
-                return;
+static const struct bench benches[] = {
+        {"collision", bench_collision},
+        {"rotate", bench_rotate},
+        {"update_shadow_location", bench_update_shadow_location},
+        {"next_random_piece", bench_next_random_piece},
+        {"clear_full_lines", bench_clear_full_lines},
+        {"lock_cycle", bench_lock_cycle}
+};
+
+static int bench_compare(const void *a, const void *b) {
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+        return (x > y) - (x < y);
+}
+
+static void bench_run(const struct bench *b, struct bench_result *r) {
+        // Warm up while finding out how many iterations fill a repetition
+        uint64_t iterations = 1000;
+        uint64_t elapsed;
+        for (;;) {
+                memcpy(bench_work_boards, bench_boards, sizeof(bench_boards));
+                uint64_t start = bench_now_ns();
+                bench_sink += b->run(iterations);
+                elapsed = bench_now_ns() - start;
+                if (elapsed >= BENCH_WARMUP_NS)
+                        break;
+                iterations *= 2;
+        }
+        iterations = iterations * BENCH_REPETITION_NS / elapsed + 1;
+
+        r->name = b->name;
+        r->iterations = iterations;
+        for (int i=0; i<BENCH_REPETITIONS; i++) {
+                memcpy(bench_work_boards, bench_boards, sizeof(bench_boards));
+                uint64_t start = bench_now_ns();
+                bench_sink += b->run(iterations);
+                r->ns_per_op[i] = (double)(bench_now_ns() - start) / iterations;
         }
 
-        int midx = st.x + (ed.x - st.x)/2;
-        int midy = st.y + (ed.y - st.y)/2;
-        int midy1 = st.y + (midy - st.y)/2;
-        int midy2 = midy;
-        int midy3 = midy + (ed.y - midy)/2;
+        double sorted[BENCH_REPETITIONS];
+        memcpy(sorted, r->ns_per_op, sizeof(sorted));
+        qsort(sorted, BENCH_REPETITIONS, sizeof(double), bench_compare);
+        r->median_ns_per_op = sorted[BENCH_REPETITIONS / 2];
+        r->min_ns_per_op = sorted[0];
+}
 
-        struct point tst1, tst2, tst3;
+int main(void) {
+        bench_make_corpus();
+
+        int count = sizeof(benches) / sizeof(benches[0]);
+        struct bench_result results[sizeof(benches) / sizeof(benches[0])];
+        
+        fprintf(stderr, "%-24s %12s %12s %16s\n", "benchmark", "ns/op", "min ns/op", "ops/sec");
+        for (int i=0; i<count; i++) {
+                bench_run(&benches[i], &results[i]);
+                fprintf(stderr, "%-24s %12.2f %12.2f %16.0f\n", results[i].name,
+                        results[i].median_ns_per_op, results[i].min_ns_per_op,
+                        1e9 / results[i].median_ns_per_op);
+        }
+
+        printf("{\n");
+        printf("  \"boards\": %d,\n", BENCH_BOARDS);
+        printf("  \"repetitions\": %d,\n", BENCH_REPETITIONS);
+        printf("  \"benchmarks\": [\n");
+        for (int i=0; i<count; i++) {
+                const struct bench_result *r = &results[i];
+                printf("    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, "
+                       "\"min_ns_per_op\": %.3f, \"ops_per_sec\": %.0f, \"samples\": [",
+                       r->name, (unsigned long long)r->iterations, r->median_ns_per_op,
+                       r->min_ns_per_op, 1e9 / r->median_ns_per_op);
+                for (int j=0; j<BENCH_REPETITIONS; j++)
+                        printf("%s%.3f", j ? ", " : "", r->ns_per_op[j]);
+                printf("]}%s\n", i < count-1 ? "," : "");
+        }
+        printf("  ]\n");
+        printf("}\n");
+
+        return EXIT_SUCCESS;
+}
+
+#endif /* BENCH */
+
+
+
+#ifdef LATENCY_HARNESS
+
+// Latency harness
+//
+// Runs the game under a pseudo-terminal, presses keys one at a time while
+// nothing else is happening on screen, and times how long it takes until
+// the output written after each one actually changes the screen. The
+// output goes through a small terminal emulator that knows about what
+// ncurses and the ANSI backend send, so output that changes nothing isn't
+// counted.
+
+#define LATENCY_DEFAULT_PRESSES 200
+#define LATENCY_ROWS 30
+#define LATENCY_COLUMNS 80
+// Keys are only pressed after the screen has been still for this long
+#define LATENCY_QUIET_US 20000L
+// More than LEGACY_HOLD_GAP_US apart, so no press looks like a held key
+#define LATENCY_PRESS_GAP_US 150000L
+// Presses that didn't change anything by then count as failed
+#define LATENCY_TIMEOUT_US 200000L
+// Presses only go in right after the piece falls a row on its own, and only
+// while the next row is still far enough away not to be taken for their
+// answer: a second on level 1, under 800 ms on level 2. Nothing a press
+// does makes the next row come any sooner.
+#define LATENCY_WINDOW_US 750000L
+#define LATENCY_FALL_TIMEOUT_US 2000000L
+// Falls waited for before a press is given up on and counted as failed
+#define LATENCY_FALL_TRIES 5
+
+struct latency_key {
+        enum input_type input;
+        const char *name;
+        const char *keys;
+        int presses; // in a row, inside the same window
+};
+
+// One round of presses, which keeps the stack low enough to last a while.
+// Nothing is taken after a hard drop until the piece locks, so the press
+// after one waits for that. Pause goes in twice, or nothing would fall
+// for the next press to wait for.
+static const struct latency_key latency_script[] = {
+        {INPUT_LEFT, "left", "\x1b[D", 1},
+        {INPUT_LEFT, "left", "\x1b[D", 1},
+        {INPUT_CLOCKWISE_ROTATION, "cw", "x", 1},
+        {INPUT_SOFT_DROP, "soft-drop", "\x1b[B", 1},
+        {INPUT_HARD_DROP, "hard-drop", " ", 1},
+        {INPUT_RIGHT, "right", "\x1b[C", 1},
+        {INPUT_COUNTERCLOCKWISE_ROTATION, "ccw", "z", 1},
+        {INPUT_HOLD, "hold", "c", 1},
+        {INPUT_HARD_DROP, "hard-drop", " ", 1},
+        {INPUT_PAUSE, "pause", "p", 2},
+        {INPUT_HARD_DROP, "hard-drop", " ", 1},
+};
+
+// The screen as the terminal would show it, the colors and bold of a cell
+// are kept as the last SGR sequence that applied to it
+struct latency_screen {
+        uint32_t ch[LATENCY_ROWS][LATENCY_COLUMNS];
+        uint32_t sgr[LATENCY_ROWS][LATENCY_COLUMNS];
+        int x, y;
+        int scroll_top, scroll_bottom;
+        uint32_t current_sgr;
+        uint32_t last_ch;
+
+        enum {PARSE_TEXT, PARSE_ESCAPE, PARSE_ESCAPE_ARGUMENT, PARSE_CSI} state;
+        int params[16];
+        int param_count;
+        bool private_csi;
+        uint32_t utf8;
+        int utf8_left;
+};
+
+struct latency_samples {
+        long *us;
+        int count;
+        int failed;
+};
+
+static long latency_now_us(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int latency_clamp(int v, int lo, int hi) {
+        return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void latency_screen_reset(struct latency_screen *s) {
+        memset(s, 0, sizeof(*s));
+        s->scroll_bottom = LATENCY_ROWS - 1;
+}
+
+static void latency_clear(struct latency_screen *s, int y, int from, int to) {
+        for (int x=from; x<to && x<LATENCY_COLUMNS; x++) {
+                s->ch[y][x] = ' ';
+                s->sgr[y][x] = s->current_sgr;
+        }
+}
+
+// Moves rows top..bottom up by n (or down, for a negative n)
+static void latency_scroll(struct latency_screen *s, int top, int bottom, int n) {
+        for (int i=0; i<abs(n); i++) {
+                if (n > 0) {
+                        memmove(s->ch[top], s->ch[top+1], sizeof(s->ch[0]) * (bottom - top));
+                        memmove(s->sgr[top], s->sgr[top+1], sizeof(s->sgr[0]) * (bottom - top));
+                        latency_clear(s, bottom, 0, LATENCY_COLUMNS);
+                } else {
+                        memmove(s->ch[top+1], s->ch[top], sizeof(s->ch[0]) * (bottom - top));
+                        memmove(s->sgr[top+1], s->sgr[top], sizeof(s->sgr[0]) * (bottom - top));
+                        latency_clear(s, top, 0, LATENCY_COLUMNS);
+                }
+        }
+}
+
+static void latency_put(struct latency_screen *s, uint32_t ch) {
+        if (s->x >= LATENCY_COLUMNS)
+                s->x = LATENCY_COLUMNS - 1;
+        s->ch[s->y][s->x] = ch;
+        s->sgr[s->y][s->x] = s->current_sgr;
+        s->last_ch = ch;
+        s->x++;
+}
+
+static void latency_csi(struct latency_screen *s, char final) {
+        int n = s->param_count > 0 && s->params[0] > 0 ? s->params[0] : 1;
+        if (s->private_csi)
+                return;
+        
+        switch (final) {
+        case 'H':
+        case 'f':
+                s->y = latency_clamp(n - 1, 0, LATENCY_ROWS - 1);
+                s->x = latency_clamp((s->param_count > 1 && s->params[1] > 0 ? s->params[1] : 1) - 1, 0, LATENCY_COLUMNS - 1);
+                break;
+        case 'A': s->y = latency_clamp(s->y - n, 0, LATENCY_ROWS - 1); break;
+        case 'B': s->y = latency_clamp(s->y + n, 0, LATENCY_ROWS - 1); break;
+        case 'C': s->x = latency_clamp(s->x + n, 0, LATENCY_COLUMNS - 1); break;
+        case 'D': s->x = latency_clamp(s->x - n, 0, LATENCY_COLUMNS - 1); break;
+        case 'd': s->y = latency_clamp(n - 1, 0, LATENCY_ROWS - 1); break;
+        case 'G': s->x = latency_clamp(n - 1, 0, LATENCY_COLUMNS - 1); break;
+        case 'X': latency_clear(s, s->y, s->x, s->x + n); break;
+        case 'b':
+                for (int i=0; i<n; i++)
+                        latency_put(s, s->last_ch);
+                break;
+        case 'K':
+                if (s->param_count == 0 || s->params[0] == 0)
+                        latency_clear(s, s->y, s->x, LATENCY_COLUMNS);
+                else if (s->params[0] == 1)
+                        latency_clear(s, s->y, 0, s->x + 1);
+                else
+                        latency_clear(s, s->y, 0, LATENCY_COLUMNS);
+                break;
+        case 'J':
+                if (s->param_count == 0 || s->params[0] == 0) {
+                        latency_clear(s, s->y, s->x, LATENCY_COLUMNS);
+                        for (int y=s->y+1; y<LATENCY_ROWS; y++)
+                                latency_clear(s, y, 0, LATENCY_COLUMNS);
+                } else {
+                        for (int y=0; y<LATENCY_ROWS; y++)
+                                latency_clear(s, y, 0, LATENCY_COLUMNS);
+                }
+                break;
+        case 'L':
+                if (s->y >= s->scroll_top && s->y <= s->scroll_bottom)
+                        latency_scroll(s, s->y, s->scroll_bottom, -n);
+                break;
+        case 'M':
+                if (s->y >= s->scroll_top && s->y <= s->scroll_bottom)
+                        latency_scroll(s, s->y, s->scroll_bottom, n);
+                break;
+        case 'S': latency_scroll(s, s->scroll_top, s->scroll_bottom, n); break;
+        case 'T': latency_scroll(s, s->scroll_top, s->scroll_bottom, -n); break;
+        case 'r':
+                s->scroll_top = latency_clamp(n - 1, 0, LATENCY_ROWS - 1);
+                s->scroll_bottom = s->param_count > 1 && s->params[1] > 0 ? latency_clamp(s->params[1] - 1, 0, LATENCY_ROWS - 1) : LATENCY_ROWS - 1;
+                s->x = s->y = 0;
+                break;
+        case 'm':
+                // Not worth decoding, a cell only has to look different
+                // when its attributes do
+                s->current_sgr = 0;
+                for (int i=0; i<s->param_count; i++)
+                        s->current_sgr = s->current_sgr * 31 + s->params[i] + 1;
+                break;
+        default:
+                break;
+        }
+}
+
+static void latency_feed(struct latency_screen *s, const unsigned char *buf, size_t len) {
+        for (size_t i=0; i<len; i++) {
+                unsigned char c = buf[i];
+                switch (s->state) {
+                case PARSE_TEXT:
+                        if (s->utf8_left > 0 && (c & 0xc0) == 0x80) {
+                                s->utf8 = s->utf8 << 6 | (c & 0x3f);
+                                if (--s->utf8_left == 0)
+                                        latency_put(s, s->utf8);
+                        } else if (c == 0x1b) {
+                                s->state = PARSE_ESCAPE;
+                        } else if (c == '\r') {
+                                s->x = 0;
+                        } else if (c == '\n') {
+                                if (s->y == s->scroll_bottom)
+                                        latency_scroll(s, s->scroll_top, s->scroll_bottom, 1);
+                                else if (s->y < LATENCY_ROWS - 1)
+                                        s->y++;
+                        } else if (c == '\b') {
+                                if (s->x > 0)
+                                        s->x--;
+                        } else if (c >= 0xe0) {
+                                s->utf8 = c & 0x0f;
+                                s->utf8_left = 2;
+                        } else if (c >= 0xc0) {
+                                s->utf8 = c & 0x1f;
+                                s->utf8_left = 1;
+                        } else if (c >= ' ' && c < 0x7f) {
+                                latency_put(s, c);
+                        }
+                        break;
+                        
+                case PARSE_ESCAPE:
+                        if (c == '[') {
+                                s->state = PARSE_CSI;
+                                s->param_count = 0;
+                                s->private_csi = false;
+                                memset(s->params, 0, sizeof(s->params));
+                        } else if (c == '(' || c == ')') {
+                                s->state = PARSE_ESCAPE_ARGUMENT;
+                        } else {
+                                if (c == 'M') {
+                                        if (s->y == s->scroll_top)
+                                                latency_scroll(s, s->scroll_top, s->scroll_bottom, -1);
+                                        else if (s->y > 0)
+                                                s->y--;
+                                }
+                                s->state = PARSE_TEXT;
+                        }
+                        break;
+
+                case PARSE_ESCAPE_ARGUMENT:
+                        s->state = PARSE_TEXT;
+                        break;
+                        
+                case PARSE_CSI:
+                        if (c >= '0' && c <= '9') {
+                                if (s->param_count == 0)
+                                        s->param_count = 1;
+                                int *p = &s->params[s->param_count - 1];
+                                *p = *p * 10 + (c - '0');
+                        } else if (c == ';') {
+                                if (s->param_count == 0)
+                                        s->param_count = 1;
+                                if (s->param_count < 16)
+                                        s->param_count++;
+                        } else if (c < '@') {
+                                s->private_csi = true; // ? > < = and the like
+                        } else {
+                                latency_csi(s, c);
+                                s->state = PARSE_TEXT;
+                        }
+                        break;
+                }
+        }
+}
+
+static bool latency_screen_shows(const struct latency_screen *s, const char *text) {
+        int len = strlen(text);
+        for (int y=0; y<LATENCY_ROWS; y++) {
+                for (int x=0; x+len<=LATENCY_COLUMNS; x++) {
+                        int i = 0;
+                        while (i < len && s->ch[y][x+i] == (unsigned char)text[i])
+                                i++;
+                        if (i == len)
+                                return true;
+                }
+        }
+        return false;
+}
+
+static bool latency_screen_differs(const struct latency_screen *a, const struct latency_screen *b) {
+        return memcmp(a->ch, b->ch, sizeof(a->ch)) != 0 || memcmp(a->sgr, b->sgr, sizeof(a->sgr)) != 0;
+}
+
+struct latency_game {
+        pid_t pid;
+        int fd;
+        struct latency_screen screen;
+};
+
+static void latency_start(struct latency_game *game, char **argv) {
+        struct winsize ws = {LATENCY_ROWS, LATENCY_COLUMNS, 0, 0};
+        game->pid = forkpty(&game->fd, NULL, NULL, &ws);
+        if (game->pid == -1) {
+                perror("forkpty");
+                exit(EXIT_FAILURE);
+        }
+        if (game->pid == 0) {
+                execv(argv[0], argv);
+                perror(argv[0]);
+                _exit(127);
+        }
+        latency_screen_reset(&game->screen);
+}
+
+// Killed outright, since a game that's asked to quit saves itself to be
+// resumed, and the next one has to start afresh
+static void latency_stop(struct latency_game *game) {
+        kill(game->pid, SIGKILL);
+        close(game->fd);
+        waitpid(game->pid, NULL, 0);
+}
+
+// Reads whatever the game writes until until_us, or until the screen
+// changes from what it was in before if that's given. Returns when it
+// last read anything, 0 if nothing, or -1 if the game is gone.
+static long latency_read(struct latency_game *game, long until_us, const struct latency_screen *before) {
+        long last = 0;
+        for (;;) {
+                long now = latency_now_us();
+                if (now >= until_us)
+                        return last;
+                
+                struct pollfd fd = {game->fd, POLLIN, 0};
+                int timeout_ms = (until_us - now + 999) / 1000;
+                if (poll(&fd, 1, timeout_ms) <= 0)
+                        continue;
+                
+                unsigned char buf[4096];
+                ssize_t n = read(game->fd, buf, sizeof(buf));
+                if (n <= 0)
+                        return -1;
+                last = latency_now_us();
+                latency_feed(&game->screen, buf, n);
+                if (before != NULL && latency_screen_differs(&game->screen, before))
+                        return last;
+        }
+}
+
+// Waits for LATENCY_QUIET_US without any output
+static bool latency_wait_quiet(struct latency_game *game) {
+        for (;;) {
+                long last = latency_read(game, latency_now_us() + LATENCY_QUIET_US, NULL);
+                if (last == -1)
+                        return false;
+                if (last == 0)
+                        return true;
+        }
+}
+
+static int latency_compare(const void *a, const void *b) {
+        long x = *(const long *)a, y = *(const long *)b;
+        return (x > y) - (x < y);
+}
+
+static long latency_percentile(const long *sorted, int count, int percent) {
+        int rank = (count * percent + 99) / 100;
+        return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+int main(int argc, char **argv) {
+        int presses = LATENCY_DEFAULT_PRESSES;
+        int first = 1;
+        if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+                presses = atoi(argv[2]);
+                first = 3;
+        }
+        if (presses <= 0 || (argc > first && argv[first][0] == '-')) {
+                fprintf(stderr, "usage: %s [-n presses] [game [args...]]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        static char *default_game[] = {"./tetrominoes", "--ansi", NULL};
+        char **game_argv = argc > first ? &argv[first] : default_game;
+
+        // Keep the high score of whoever runs this out of it
+        char data_home[] = "/tmp/tetrominoes_latency.XXXXXX";
+        if (mkdtemp(data_home) == NULL) {
+                perror("mkdtemp");
+                return EXIT_FAILURE;
+        }
+        setenv("XDG_DATA_HOME", data_home, 1);
+        if (getenv("TERM") == NULL)
+                setenv("TERM", "xterm", 1);
+        signal(SIGPIPE, SIG_IGN);
+        
+        static struct latency_samples samples[INPUT_EXIT + 1];
+        for (int t=0; t<=INPUT_EXIT; t++) {
+                samples[t].us = malloc((presses + 1) * sizeof(long)); // a pair may go one over
+                if (samples[t].us == NULL) {
+                        perror("malloc");
+                        return EXIT_FAILURE;
+                }
+        }
+
+        struct latency_game game;
+        latency_start(&game, game_argv);
+        int restarts = 0;
+        
+        int script_length = sizeof(latency_script) / sizeof(latency_script[0]);
+        long last_press = 0;
+        long window_end = 0;
+        int fall_tries = 0;
+        int pressed = 0, failed = 0;
+        for (int i=0; pressed<presses; ) {
+                const struct latency_key *k = &latency_script[i % script_length];
+                struct latency_samples *s = &samples[k->input];
+
+                static struct latency_screen before;
+                
+                // Start over once the game tops out, the next press would
+                // only quit it
+                if (latency_read(&game, last_press + LATENCY_PRESS_GAP_US, NULL) == -1 ||
+                    !latency_wait_quiet(&game) || latency_screen_shows(&game.screen, GAMEOVER_TEXT)) {
+                        latency_stop(&game);
+                        latency_start(&game, game_argv);
+                        restarts++;
+                        window_end = 0;
+                        fall_tries = 0;
+                        continue;
+                }
+
+                // Left paused by a pause that failed: unpause, unmeasured.
+                // Nothing falls while paused, so pause itself goes right in.
+                bool paused = latency_screen_shows(&game.screen, PAUSED_TEXT);
+                if (paused && k->input != INPUT_PAUSE) {
+                        last_press = latency_now_us();
+                        if (write(game.fd, "p", 1) == -1) {
+                                perror("write");
+                                break;
+                        }
+                        window_end = 0;
+                        continue;
+                }
+
+                // Wait for the piece to fall on its own, so that it won't
+                // again until well after the answer to the presses
+                if (!paused && latency_now_us() + k->presses * (LATENCY_TIMEOUT_US + LATENCY_PRESS_GAP_US) > window_end) {
+                        if (fall_tries == LATENCY_FALL_TRIES) {
+                                s->failed += k->presses;
+                                failed += k->presses;
+                                pressed += k->presses;
+                                fall_tries = 0;
+                                i++;
+                                continue;
+                        }
+                        fall_tries++;
+                        before = game.screen;
+                        long fell = latency_read(&game, latency_now_us() + LATENCY_FALL_TIMEOUT_US, &before);
+                        if (fell > 0 && latency_screen_differs(&game.screen, &before))
+                                window_end = fell + LATENCY_WINDOW_US;
+                        continue;
+                }
+                fall_tries = 0;
+                
+                for (int j=0; j<k->presses; j++) {
+                        if (j > 0 && (latency_read(&game, last_press + LATENCY_PRESS_GAP_US, NULL) == -1 ||
+                                      !latency_wait_quiet(&game)))
+                                break;
+                        
+                        before = game.screen;
+                        last_press = latency_now_us();
+                        if (write(game.fd, k->keys, strlen(k->keys)) == -1) {
+                                perror("write");
+                                break;
+                        }
+                        
+                        long changed = latency_read(&game, last_press + LATENCY_TIMEOUT_US, &before);
+                        if (changed > 0 && latency_screen_differs(&game.screen, &before)) {
+                                s->us[s->count++] = changed - last_press;
+                        } else {
+                                s->failed++;
+                                failed++;
+                        }
+                        pressed++;
+                }
+                
+                // The next press has to wait for the lock
+                if (k->input == INPUT_HARD_DROP)
+                        window_end = 0;
+                i++;
+        }
+        latency_stop(&game);
+
+        // Everything the game saved goes in a directory of its own
+        char data_dir[sizeof(data_home) + sizeof("/tetrominoes")];
+        snprintf(data_dir, sizeof(data_dir), "%s/tetrominoes", data_home);
+        DIR *dir = opendir(data_dir);
+        if (dir != NULL) {
+                struct dirent *entry;
+                while ((entry = readdir(dir)) != NULL)
+                        unlinkat(dirfd(dir), entry->d_name, 0);
+                closedir(dir);
+        }
+        rmdir(data_dir);
+        rmdir(data_home);
+        
+        printf("%d presses on %s, %d failed, restarted %d times\n", pressed, game_argv[0], failed, restarts);
+        printf("%-10s %7s %9s %9s %9s %9s %9s\n", "input", "samples", "failed", "p50 us", "p90 us", "p99 us", "max us");
+        for (int t=0; t<=INPUT_EXIT; t++) {
+                struct latency_samples *s = &samples[t];
+                if (s->count == 0 && s->failed == 0)
+                        continue;
+                
+                const char *name = NULL;
+                for (int j=0; j<script_length; j++)
+                        if (latency_script[j].input == (enum input_type)t)
+                                name = latency_script[j].name;
+
+                if (s->count == 0) {
+                        printf("%-10s %7d %9d\n", name, 0, s->failed);
+                        continue;
+                }
+                qsort(s->us, s->count, sizeof(long), latency_compare);
+                printf("%-10s %7d %9d %9ld %9ld %9ld %9ld\n", name, s->count, s->failed,
+                       latency_percentile(s->us, s->count, 50), latency_percentile(s->us, s->count, 90),
+                       latency_percentile(s->us, s->count, 99), s->us[s->count - 1]);
+        }
+        
+        return EXIT_SUCCESS;
+}
+
+#endif /* LATENCY_HARNESS */
+
+
+
+#ifndef TETRIS_LIBRARY
+
+// Globals (frontend state)
+
+static long hiscore;
+
+// A finished game, as it is on disk in the leaderboard and the history
+struct game_record {
+        int64_t score;
+        int64_t date; // when the game ended, seconds since the epoch
+        uint32_t lines;
+        uint32_t level;
+        uint32_t duration_s;
+        uint32_t reserved;
+};
+
+// The best games, best first. This is the file as it is on disk, so its
+// layout only changes along with LEADERBOARD_VERSION.
+struct leaderboard {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t count;
+        uint32_t reserved;
+        struct game_record entries[LEADERBOARD_ENTRIES];
+};
+
+// Every game ever finished is appended to the history, which is only
+// records back to back in the order the games ended, and so by date. The
+// index next to it covers the first count of them: totals and bests, then
+// the numbers of those records sorted by score. It's only brought up to
+// date every HISTORY_INDEX_INTERVAL games, readers add the ones after that
+// to it themselves.
+struct history_index_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t count;
+        uint32_t reserved;
+        int64_t total_score;
+        uint64_t total_lines;
+        uint64_t total_levels;
+        uint64_t total_duration_s;
+        uint32_t best_lines;
+        uint32_t best_level;
+        uint32_t longest_s;
+        uint32_t reserved2;
+};
+
+struct history {
+        const struct game_record *records;
+        uint32_t count;
+        void *mapped; // the history file
+        size_t mapped_size;
+        struct history_index_header header;
+        uint32_t *by_score;
+};
+
+// A game that was left before it was over, to be picked up again on the
+// next start. The checksum covers everything after it.
+struct saved_game {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t game_size;
+        uint32_t reserved;
+        uint64_t checksum;
+        int64_t played_us; // how long it had been played
+        struct tetris_game game;
+};
+
+// A replay is the seed and rotation system of a game, and then each input
+// it took with the number of ticks since the one before, both in a single
+// varint. An INPUT_NONE ends it, on the tick the game did. All it takes to
+// write one is filling a buffer, which is only written out when it's full,
+// once a game gets hours long.
+static struct replay_recorder {
+        FILE *f; // NULL when not recording
+        uint64_t ticks; // played so far, not counting any while paused or over
+        uint64_t last_event_tick;
+} recorder;
+
+// The game being played, to be saved or recorded at exit
+static struct {
+        const struct tetris_game *game;
+        long start_us;
+        bool recording; // never saved, so it can't replace a saved game
+} played;
+
+// Ticks are due every TETRIS_TICK_US from when the game started, going by
+// CLOCK_MONOTONIC, no matter how long anything in between takes
+static struct tick_scheduler {
+        int timer;
+        bool running;
+        long next_tick_us;
+
+        long ticks;
+        long caught_up; // ran late in a batch to make up for a slow frame
+        long dropped; // given up on after falling too far behind
+        long total_late_us;
+        long max_late_us;
+        long late_histogram[TICK_LATE_BUCKETS]; // bucket i is up to 2^i us late
+} scheduler;
+static bool print_tick_stats_at_exit;
+
+// Bytes read from the terminal that haven't made a whole key event yet
+static struct terminal_input {
+        unsigned char buf[256];
+        int len;
+        bool kitty; // the terminal answered the kitty keyboard protocol query
+} terminal;
+
+static volatile sig_atomic_t terminal_resized;
+static volatile sig_atomic_t quit_requested; // by SIGHUP or SIGTERM
+// The game thread only takes those while it waits with this mask, so none
+// can come in between checking quit_requested and waiting
+static sigset_t game_wait_mask;
+
+// What the game thread hands over to the render thread
+struct snapshot {
+        struct tetris_game game;
+        long hiscore;
+        bool phase_overlay;
+};
+
+// The game thread fills the back slot and swaps it with the middle one,
+// the render thread swaps the front slot with the middle one whenever
+// that's fresh. Neither ever waits for the other, and a snapshot isn't
+// written to while it's being drawn.
+#define SNAPSHOT_FRESH 4u
+
+static struct snapshot_buffer {
+        struct snapshot slots[3];
+        unsigned back; // only touched by the game thread
+        unsigned middle; // slot index, or'd with SNAPSHOT_FRESH if not taken yet
+        unsigned front; // only touched by the render thread
+        int wakeup; // eventfd the render thread sleeps on
+} snapshots = {.back = 0, .middle = 1, .front = 2, .wakeup = -1};
+
+static pthread_t render_thread;
+static bool render_thread_running;
+static bool render_thread_quit;
+
+struct frame_cell {
+        uint16_t ch; // a Unicode code point
+        uint8_t fg; // enum tetris_color
+        uint8_t bg;
+        bool bold;
+};
+
+struct frame {
+        int width;
+        int height;
+        struct frame_cell *cells;
+};
+
+// The frame being drawn, and the one that's on the screen
+static struct frame frame, shown_frame;
+
+// Draw blocks as the top or bottom half of a character cell, a cell wide,
+// instead of as two whole cells side by side
+static bool half_blocks;
+
+// How frames get to the terminal: through ncurses, or written straight out
+// as ANSI escape sequences
+static enum render_backend {
+        RENDER_CURSES,
+        RENDER_ANSI
+} render_backend;
+
+// Where the ANSI backend puts a whole frame together before writing it,
+// big enough for the worst case of a frame where every cell changed
+static struct ansi_buffer {
+        char *data;
+        size_t len;
+        size_t size;
+        int fd;
+} ansi = {.fd = STDOUT_FILENO};
+
+// How many calls into ncurses, or write()s for the ANSI backend, presenting
+// frames took so far
+static long output_calls;
+
+// Top left (st) and bottom right (ed, exclusive) corners of everything on screen
+static struct layout {
+        struct point max;
+        struct point pf_st, pf_ed; // playfield, including the hidden rows above the screen
+        struct point pf_visible_st; // where the visible rows start
+        struct point sc_st, sc_ed; // score
+        struct point nx_st, nx_ed; // next pieces
+        struct point hd_st, hd_ed; // held piece
+        struct point hs_st, hs_ed; // hiscore
+        struct point cs_st, cs_ed; // controls
+        struct point cs_text; // where the controls text starts
+        struct point lv_st, lv_ed; // level
+        struct point go_st, go_ed; // game over
+        struct point go_text; // where the game over text starts
+        struct point ov_st; // phase timing overlay
+} layout;
+
+enum key_event_type {
+        KEY_EVENT_PRESS,
+        KEY_EVENT_REPEAT,
+        KEY_EVENT_RELEASE
+};
+
+struct key_event {
+        int key; // same codes as getch()
+        enum key_event_type type;
+};
+
+// Delayed auto shift and auto repeat rate of each action. A negative DAS
+// means the action never repeats, an ARR of 0 repeats it as far as it goes.
+static struct action_timing {
+        long das_us;
+        long arr_us;
+} action_timings[INPUT_EXIT + 1] = {
+        [INPUT_NONE] = {-1, 0},
+        [INPUT_CLOCKWISE_ROTATION] = {-1, 0},
+        [INPUT_HARD_DROP] = {-1, 0},
+        [INPUT_HOLD] = {-1, 0},
+        [INPUT_COUNTERCLOCKWISE_ROTATION] = {-1, 0},
+        [INPUT_SOFT_DROP] = {0, 33000},
+        [INPUT_LEFT] = {167000, 33000},
+        [INPUT_RIGHT] = {167000, 33000},
+        [INPUT_PAUSE] = {-1, 0},
+        [INPUT_EXIT] = {-1, 0}
+};
+
+static const char *action_names[INPUT_EXIT + 1] = {
+        [INPUT_CLOCKWISE_ROTATION] = "cw",
+        [INPUT_HARD_DROP] = "hard-drop",
+        [INPUT_HOLD] = "hold",
+        [INPUT_COUNTERCLOCKWISE_ROTATION] = "ccw",
+        [INPUT_SOFT_DROP] = "soft-drop",
+        [INPUT_LEFT] = "left",
+        [INPUT_RIGHT] = "right"
+};
+
+static struct held_action {
+        bool held;
+        bool repeating;
+        long held_since_us;
+        long last_seen_us;
+        long next_repeat_us;
+} held_actions[INPUT_EXIT + 1];
+
+// What every pass of the game and render loops spends its time on. The
+// game thread times the first three and the render thread the rest.
+enum phase {
+        PHASE_WAIT = TRACE_WAIT, // asleep until a key or a tick
+        PHASE_STEP = TRACE_STEP,
+        PHASE_INPUT = TRACE_INPUT,
+        PHASE_DRAW = TRACE_DRAW, // into the frame
+        PHASE_PRESENT = TRACE_PRESENT, // out to the terminal
+        PHASE_COUNT
+};
+
+static const char *const phase_names[PHASE_COUNT] = {"wait", "step", "input", "draw", "present"};
+
+// Each one is only written by the thread that times it, the overlay reads
+// them all
+static struct phase_histogram {
+        long count;
+        long max_ns;
+        long buckets[PHASE_BUCKETS]; // bucket i is under 2^i ns
+} phase_histograms[PHASE_COUNT];
+
+static bool show_phase_overlay;
+
+// A span, or an instant when it has no duration
+struct trace_event {
+        int64_t ts_ns;
+        int64_t dur_ns; // waits while paused last as long as the pause
+        uint8_t name; // enum trace_name
+        bool instant;
+};
+
+// Filled from both threads, and only read at exit once they're done
+static struct trace_buffer {
+        struct trace_event *events;
+        unsigned long next; // total recorded, events[next % TRACE_EVENTS] is the next one
+        long start_ns;
+        const char *filename;
+} trace_log;
+
+// Where each thread's span in progress started, so that spans of the same
+// name on both threads don't cut each other short
+static __thread long trace_begin_ns[TRACE_NAMES];
+
+static const char *const trace_names[TRACE_NAMES] = {
+        "wait", "step", "input", "draw", "present",
+        "clear_lines", "hiscore_save",
+        "lock", "hold", "line_clear", "level_up"
+};
+
+
+
+// Utils functions
+
+// ensure we don't wrte *dest beyond *n characters and at the end modify *n to
+// indicate how many characters of src we wrote. If we didn't write fully dest,
+// return false otherwise true
+static bool mystrncpy(char **dest, const char *src, size_t *n) {
+        while (*src != '\0') {
+                if (*n <= 0) {
+                        return false;
+                }
+                
+                **dest = *src;
+                
+                (*dest)++;
+                src++;
+                
+                (*n)--;
+        }
+
+        return true;
+}
+
+static bool create_directory_if_not_exists(const char *dir) {
+        struct stat st;
+        
+        if (stat(dir, &st) == -1) {
+                if (mkdir(dir, 0700) == -1) {
+                        perror(dir);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static bool make_directory_exist(const char *filename) {
+        char *directory = strdup(filename);
+        
+        size_t i = 0;
+        for (;;) {
+                while (directory[i] != '/' && directory[i] != '\0') {
+                        i++;
+                }
+                
+                if (directory[i] == '\0' || directory[i+1] == '\0') {
+                        break;
+                }
+                
+                i++;
+                char c = directory[i];
+                directory[i] = '\0';
+                if (!create_directory_if_not_exists(directory)) {
+                        return false;
+                }
+                directory[i] = c;
+        }
+        
+        free(directory);
+        return true;
+}
+
+static void endwin_wrapper(void) {
+        // Leave the keyboard protocol the way we found it
+        static const char pop_keyboard_flags[] = "\x1b[<u";
+        if (write(STDOUT_FILENO, pop_keyboard_flags, sizeof(pop_keyboard_flags) - 1) == -1)
+                perror("write");
+        endwin();
+}
+
+
+
+// Colors functions
+
+static void setup_colors(void) {
+        start_color();
+}
+
+static short curses_color(enum tetris_color c) {
+        switch (c) {
+        case TETRIS_COLOR_CYAN:
+                return COLOR_CYAN;
+        case TETRIS_COLOR_YELLOW:
+                return COLOR_YELLOW;
+        case TETRIS_COLOR_PURPLE:
+                return COLOR_MAGENTA;
+        case TETRIS_COLOR_GREEN:
+                return COLOR_GREEN;
+        case TETRIS_COLOR_RED:
+                return COLOR_RED;
+        case TETRIS_COLOR_BLUE:
+                return COLOR_BLUE;
+        case TETRIS_COLOR_ORANGE:
+                return COLOR_YELLOW; // This should be orange, but we don't have this color.
+        case TETRIS_COLOR_WHITE:
+                return COLOR_WHITE;
+        case TETRIS_COLOR_BLACK:
+        default:
+                return COLOR_BLACK;
+        }
+}
+
+// Color pairs are made the first time each combination is drawn
+static int color_pair(enum tetris_color fg, enum tetris_color bg) {
+        static short pairs[TETRIS_COLOR_WHITE+1][TETRIS_COLOR_WHITE+1];
+        static short next_pair = 1;
+
+        if (pairs[fg][bg] == 0) {
+                if (next_pair >= COLOR_PAIRS)
+                        return 0;
+                init_pair(next_pair, curses_color(fg), curses_color(bg));
+                pairs[fg][bg] = next_pair++;
+        }
+        return pairs[fg][bg];
+}
+
+
+
+// Frame functions
+
+// Everything is drawn into a frame first. Presenting it only sends the
+// cells that changed since the last frame that was presented.
+static void frame_resize(struct frame *f, int width, int height) {
+        free(f->cells);
+        f->width = width;
+        f->height = height;
+        f->cells = calloc((size_t)width * height, sizeof(*f->cells));
+        if (f->cells == NULL) {
+                endwin();
+                perror("calloc");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void frame_put(struct frame *f, int x, int y, uint16_t ch, enum tetris_color fg, enum tetris_color bg, bool bold) {
+        if (x < 0 || y < 0 || x >= f->width || y >= f->height)
+                return;
+
+        struct frame_cell *cell = &f->cells[y * f->width + x];
+        cell->ch = ch;
+        cell->fg = fg;
+        cell->bg = bg;
+        cell->bold = bold;
+}
+
+// A half-block cell shows its top half in the foreground color and its
+// bottom half in the background color. y counts half cells here.
+static void frame_put_half(struct frame *f, int x, int y, enum tetris_color color) {
+        if (x < 0 || y < 0 || x >= f->width || y/2 >= f->height)
+                return;
+
+        struct frame_cell *cell = &f->cells[y/2 * f->width + x];
+        if (cell->ch != UPPER_HALF_BLOCK)
+                *cell = (struct frame_cell){UPPER_HALF_BLOCK, TETRIS_COLOR_BLACK, TETRIS_COLOR_BLACK, false};
+        if (y % 2 == 0)
+                cell->fg = color;
+        else
+                cell->bg = color;
+}
+
+static bool frame_cell_equal(const struct frame_cell *a, const struct frame_cell *b) {
+        return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg && a->bold == b->bold;
+}
+
+static void frame_text(struct frame *f, int x, int y, bool bold, const char *text) {
+        for (int i=0; text[i] != '\0'; i++)
+                frame_put(f, x+i, y, text[i], TETRIS_COLOR_WHITE, TETRIS_COLOR_BLACK, bold);
+}
+
+// Forget what's on the screen, so that the next frame is sent whole
+static void frame_invalidate(struct frame *f) {
+        memset(f->cells, 0, (size_t)f->width * f->height * sizeof(*f->cells));
+}
+
+static void ansi_append(struct ansi_buffer *b, const char *s, size_t n) {
+        memcpy(b->data + b->len, s, n);
+        b->len += n;
+}
+
+static void ansi_append_uint(struct ansi_buffer *b, unsigned n) {
+        char digits[10];
+        int i = 0;
+        do {
+                digits[i++] = '0' + n % 10;
+                n /= 10;
+        } while (n > 0);
+        while (i > 0)
+                b->data[b->len++] = digits[--i];
+}
+
+static int ansi_color(enum tetris_color c) {
+        switch (c) {
+        case TETRIS_COLOR_RED:
+                return 1;
+        case TETRIS_COLOR_GREEN:
+                return 2;
+        case TETRIS_COLOR_YELLOW:
+        case TETRIS_COLOR_ORANGE: // the same as with ncurses
+                return 3;
+        case TETRIS_COLOR_BLUE:
+                return 4;
+        case TETRIS_COLOR_PURPLE:
+                return 5;
+        case TETRIS_COLOR_CYAN:
+                return 6;
+        case TETRIS_COLOR_WHITE:
+                return 7;
+        case TETRIS_COLOR_BLACK:
+        default:
+                return 0;
+        }
+}
+
+// Worst case for one cell: a cursor move, a full SGR and the character
+#define ANSI_CELL_MAX_BYTES 32
+#define ANSI_FRAME_EXTRA_BYTES 32
+
+static void ansi_resize(struct ansi_buffer *b, int width, int height) {
+        free(b->data);
+        b->size = (size_t)width * height * ANSI_CELL_MAX_BYTES + ANSI_FRAME_EXTRA_BYTES;
+        b->data = malloc(b->size);
+        if (b->data == NULL) {
+                endwin();
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+}
+
+// Same as frame_present(), but the changes are sent with a single write()
+// inside a synchronized update, so the terminal shows them all at once.
+// The cursor is only moved when the next changed cell isn't the one right
+// after the last, and colors only change between runs.
+static void frame_present_ansi(const struct frame *f, struct frame *shown) {
+        static const char sync_begin[] = "\x1b[?2026h";
+        static const char sync_end[] = "\x1b[0m\x1b[?2026l";
+        static const char sgr_normal[] = "\x1b[0;3";
+        static const char sgr_bold[] = "\x1b[0;1;3";
+        struct ansi_buffer *b = &ansi;
+        
+        b->len = 0;
+        ansi_append(b, sync_begin, sizeof(sync_begin) - 1);
+
+        struct point cursor = {-1, -1};
+        const struct frame_cell *style = NULL;
+        for (int y=0; y<f->height; y++) {
+                for (int x=0; x<f->width; x++) {
+                        int i = y * f->width + x;
+                        const struct frame_cell *cell = &f->cells[i];
+                        if (frame_cell_equal(cell, &shown->cells[i]))
+                                continue;
+
+                        if (cursor.x != x || cursor.y != y) {
+                                ansi_append(b, "\x1b[", 2);
+                                ansi_append_uint(b, y + 1);
+                                ansi_append(b, ";", 1);
+                                ansi_append_uint(b, x + 1);
+                                ansi_append(b, "H", 1);
+                        }
+                        if (style == NULL || style->fg != cell->fg || style->bg != cell->bg || style->bold != cell->bold) {
+                                if (cell->bold)
+                                        ansi_append(b, sgr_bold, sizeof(sgr_bold) - 1);
+                                else
+                                        ansi_append(b, sgr_normal, sizeof(sgr_normal) - 1);
+                                ansi_append_uint(b, ansi_color(cell->fg));
+                                ansi_append(b, ";4", 2);
+                                ansi_append_uint(b, ansi_color(cell->bg));
+                                ansi_append(b, "m", 1);
+                                style = cell;
+                        }
+                        // UTF-8, a cell only holds the BMP so it takes up to
+                        // three bytes
+                        if (cell->ch < 0x80) {
+                                b->data[b->len++] = cell->ch;
+                        } else if (cell->ch < 0x800) {
+                                b->data[b->len++] = 0xc0 | (cell->ch >> 6);
+                                b->data[b->len++] = 0x80 | (cell->ch & 0x3f);
+                        } else {
+                                b->data[b->len++] = 0xe0 | (cell->ch >> 12);
+                                b->data[b->len++] = 0x80 | ((cell->ch >> 6) & 0x3f);
+                                b->data[b->len++] = 0x80 | (cell->ch & 0x3f);
+                        }
+                        
+                        cursor.x = x + 1;
+                        cursor.y = y;
+                        shown->cells[i] = *cell;
+                }
+        }
+
+        if (style == NULL)
+                return;
+        ansi_append(b, sync_end, sizeof(sync_end) - 1);
+
+        size_t written = 0;
+        while (written < b->len) {
+                ssize_t n = write(b->fd, b->data + written, b->len - written);
+                output_calls++;
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        // The terminal shares the non-blocking stdin's file
+                        // description, so it can be full for a while
+                        if (errno == EAGAIN) {
+                                struct pollfd fd = {b->fd, POLLOUT, 0};
+                                poll(&fd, 1, -1);
+                                continue;
+                        }
+                        // Cells that were marked shown may not have been,
+                        // so the next frame goes out whole
+                        frame_invalidate(shown);
+                        return;
+                }
+                written += n;
+        }
+}
+
+static void frame_present(const struct frame *f, struct frame *shown) {
+        if (render_backend == RENDER_ANSI) {
+                frame_present_ansi(f, shown);
+                return;
+        }
+        
+        bool changed = false;
+        attr_t current = A_NORMAL;
+
+        attrset(current);
+        output_calls++;
+        for (int y=0; y<f->height; y++) {
+                for (int x=0; x<f->width; x++) {
+                        int i = y * f->width + x;
+                        const struct frame_cell *cell = &f->cells[i];
+                        if (frame_cell_equal(cell, &shown->cells[i]))
+                                continue;
+
+                        int pair = color_pair(cell->fg, cell->bg);
+                        attr_t attr = COLOR_PAIR(pair) | (cell->bold ? A_BOLD : A_NORMAL);
+                        if (cell->ch < 0x80) {
+                                if (attr != current) {
+                                        attrset(attr);
+                                        current = attr;
+                                        output_calls++;
+                                }
+                                mvaddch(y, x, cell->ch);
+                                output_calls++;
+                        } else {
+                                wchar_t wc[2] = {cell->ch, L'\0'};
+                                cchar_t cc;
+                                setcchar(&cc, wc, attr & ~A_COLOR, pair, NULL);
+                                mvadd_wch(y, x, &cc);
+                                output_calls += 2;
+                        }
+                        shown->cells[i] = *cell;
+                        changed = true;
+                }
+        }
+        attrset(A_NORMAL);
+        output_calls++;
+
+        if (changed) {
+                refresh();
+                output_calls++;
+        }
+}
+
+
+
+// Trace functions
+
+static long now_ns(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void trace_record(enum trace_name name, long ts_ns, long dur_ns, bool instant) {
+        unsigned long i = __atomic_fetch_add(&trace_log.next, 1, __ATOMIC_RELAXED);
+        struct trace_event *e = &trace_log.events[i % TRACE_EVENTS];
+        e->ts_ns = ts_ns;
+        e->dur_ns = dur_ns;
+        e->name = name;
+        e->instant = instant;
+}
+
+static void trace_begin(enum trace_name name) {
+        trace_begin_ns[name] = now_ns();
+}
+
+static void trace_end(enum trace_name name) {
+        trace_record(name, trace_begin_ns[name], now_ns() - trace_begin_ns[name], false);
+}
+
+static void trace_instant(enum trace_name name) {
+        trace_record(name, now_ns(), 0, true);
+}
+
+// Chrome's trace event format, which Perfetto also reads. The frame phases
+// draw and present happen on the render thread, everything else on the
+// game thread.
+static void trace_write(void) {
+        FILE *f = fopen(trace_log.filename, "w");
+        if (f == NULL) {
+                perror(trace_log.filename);
+                return;
+        }
+        
+        fprintf(f, "{\"traceEvents\": [\n");
+        fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"game\"}},\n");
+        fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"render\"}}");
+        
+        unsigned long first = trace_log.next > TRACE_EVENTS ? trace_log.next - TRACE_EVENTS : 0;
+        for (unsigned long i=first; i<trace_log.next; i++) {
+                const struct trace_event *e = &trace_log.events[i % TRACE_EVENTS];
+                int tid = e->name == TRACE_DRAW || e->name == TRACE_PRESENT ? 2 : 1;
+                double ts = (e->ts_ns - trace_log.start_ns) / 1e3;
+                if (e->instant)
+                        fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d}",
+                                trace_names[e->name], ts, tid);
+                else
+                        fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d}",
+                                trace_names[e->name], ts, e->dur_ns / 1e3, tid);
+        }
+        fprintf(f, "\n], \"displayTimeUnit\": \"ns\"}\n");
+        fclose(f);
+}
+
+// Tracing is on when TETROMINOES_TRACE names the file to write it to. All
+// of the memory it needs is taken here, recording is a clock read and a
+// few stores.
+static void init_tracing(void) {
+        trace_log.filename = getenv(TRACE_ENV);
+        if (trace_log.filename == NULL || trace_log.filename[0] == '\0')
+                return;
+
+        trace_log.events = calloc(TRACE_EVENTS, sizeof(*trace_log.events));
+        if (trace_log.events == NULL) {
+                perror("calloc");
+                return;
+        }
+        trace_log.start_ns = now_ns();
+        tracing = true;
+        atexit(trace_write);
+}
+
+
+
+// Phase timing functions
+
+static void phase_record(enum phase p, long ns) {
+        struct phase_histogram *h = &phase_histograms[p];
+        int bucket = ns > 0 ? 64 - __builtin_clzl(ns) : 0;
+        if (bucket > PHASE_BUCKETS-1)
+                bucket = PHASE_BUCKETS-1;
+
+        __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->buckets[bucket], h->buckets[bucket] + 1, __ATOMIC_RELAXED);
+        if (ns > h->max_ns)
+                __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+// Times since *start, and moves it up to now
+static void phase_end(enum phase p, long *start) {
+        long now = now_ns();
+        phase_record(p, now - *start);
+        if (tracing)
+                trace_record((enum trace_name)p, *start, now - *start, false);
+        *start = now;
+}
+
+// Upper end of the bucket where the given percentile falls, or the
+// maximum if that's lower
+static long phase_percentile_ns(const struct phase_histogram *h, int percent) {
+        long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        long max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+        long rank = (count * percent + 99) / 100;
+        long seen = 0;
+        for (int i=0; i<PHASE_BUCKETS; i++) {
+                seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+                if (seen >= rank)
+                        return (1L << i) < max ? (1L << i) : max;
+        }
+        return max;
+}
+
+// Room for any long in ns
+#define DURATION_TEXT_SIZE sizeof("-9223372036854775808ns")
+
+static void format_duration(char text[DURATION_TEXT_SIZE], long ns) {
+        const size_t size = DURATION_TEXT_SIZE;
+        if (ns < 1000)
+                snprintf(text, size, "%ldns", ns);
+        else if (ns < 1000000)
+                snprintf(text, size, "%.1fus", ns / 1e3);
+        else if (ns < 1000000000)
+                snprintf(text, size, "%.1fms", ns / 1e6);
+        else
+                snprintf(text, size, "%.1fs", ns / 1e9);
+}
+
+
+
+// Drawing functions
+
+static void decide_rotation_offset_draw_tetrimino(enum tetrimino t,
+                                                  enum tetrimino_rotation *r, struct point *o) {
+        switch(t) {
+        case TETRIMINO_TEST:
+                *r = SPAWN_ROTATED;
+                o->x = 0;
+                o->y = 0;
+                break;
+        case TETRIMINO_I:
+                *r = SPAWN_ROTATED;
+                o->x = -2;
+                o->y = 1;
+                break;
+        case TETRIMINO_O:
+                *r = SPAWN_ROTATED;
+                o->x = -2;
+                o->y = 1;
+                break;
+        case TETRIMINO_T:
+                *r = SPAWN_ROTATED;
+                o->x = -1;
+                o->y = 1;
+                break;
+        case TETRIMINO_S:
+                *r = SPAWN_ROTATED;
+                o->x = -1;
+                o->y = 1;
+                break;
+        case TETRIMINO_Z:
+                *r = SPAWN_ROTATED;
+                o->x = -1;
+                o->y = 1;
+                break;
+        case TETRIMINO_J:
+                *r = SPAWN_ROTATED;
+                o->x = -1;
+                o->y = 1;
+                break;
+        case TETRIMINO_L:
+                *r = SPAWN_ROTATED;
+                o->x = -1;
+                o->y = 1;
+                break;
+        }
+}
+
+static void draw(struct point st, struct point ed, enum tetris_color c) {
+        for (int x=st.x; x<ed.x; x++) {
+                for (int y=st.y; y<ed.y; y++) {
+                        frame_put(&frame, x, y, DRAWING_CHAR, c, c, false);
+                }
+        }
+}
+
+// One block of the playfield, or of a piece, at block x, y of an area that
+// starts at st. A shadow block is drawn hollow, or grey with half blocks.
+static void draw_block(struct point st, int x, int y, enum tetris_color color, bool shadow) {
+        if (half_blocks) {
+                frame_put_half(&frame, st.x+x, st.y*2+y, shadow ? TETRIS_COLOR_WHITE : color);
+                return;
+        }
+        
+        enum tetris_color bg = shadow ? TETRIS_COLOR_BLACK : color;
+        frame_put(&frame, st.x+x*2, st.y+y, DRAWING_CHAR, color, bg, false);
+        frame_put(&frame, st.x+x*2+1, st.y+y, DRAWING_CHAR, color, bg, false);
+}
+
+static void draw_tetrimino(enum tetrimino t, struct point c) {
+        enum tetris_color color = piece_color(t);
+
+        if (half_blocks) {
+                // Centered on the middle of the 4x4 box at c, in a single row
+                const struct piece_shape *shape = &piece_shapes[t][SPAWN_ROTATED];
+                struct point st;
+                st.x = c.x + 2 - (shape->right - shape->left + 1)/2 - shape->left;
+                st.y = c.y + 2;
+                for (int j=shape->top; j<=shape->bottom; j++)
+                        for (int i=shape->left; i<=shape->right; i++)
+                                if ((shape->rows[j] >> i) & 1)
+                                        draw_block(st, i, j - shape->top, color, false);
+                return;
+        }
+        
+        enum tetrimino_rotation r = SPAWN_ROTATED;
+        struct point o = {0, 0};
+        decide_rotation_offset_draw_tetrimino(t, &r, &o);
+        
+        const struct piece_shape *shape = &piece_shapes[t][r];
+        for (int j=shape->top; j<=shape->bottom; j++) {
+                for (int i=shape->left; i<=shape->right; i++) {
+                        if ((shape->rows[j] >> i) & 1) {
+                                frame_put(&frame, c.x+i*2+o.x, c.y+j+o.y, DRAWING_CHAR, color, color, false);
+                                frame_put(&frame, c.x+i*2+1+o.x, c.y+j+o.y, DRAWING_CHAR, color, color, false);
+                        }
+                        
+                }
+        }
+}
+
+static void draw_background(struct point max) {
+        draw((struct point){0, 0}, max, TETRIS_COLOR_WHITE);
+}
+
+static void draw_playfield_piece(const struct tetris_game *g, struct point st, struct point location, bool shadow) {
+        const struct piece_shape *shape = &piece_shapes[g->current_piece][g->current_piece_rotation];
+        enum tetris_color color = piece_color(g->current_piece);
+        
+        for (int j=shape->top; j<=shape->bottom; j++) {
+                int y = location.y + j;
+                if (y < TETRIS_PLAYFIELD_Y/2)
+                        continue;
+                
+                for (int i=shape->left; i<=shape->right; i++) {
+                        if ((shape->rows[j] >> i) & 1)
+                                draw_block(st, location.x + i, y, color, shadow);
+                }
+        }
+}
+
+static void draw_playfield(const struct tetris_game *g, struct point st, struct point visible_st, struct point ed) {
+        if (g->paused) {
+                draw(visible_st, ed, TETRIS_COLOR_BLACK);
+                
+                const char text[] = PAUSED_TEXT;
+                const unsigned textlen = sizeof(text);
+                int x = st.x + (ed.x - st.x)/2 - textlen/2;
+                int y = st.y + 3*(ed.y - st.y)/4;
+                frame_text(&frame, x, y, false, text);
+                return;
+        }
+        
+        for (int j=TETRIS_PLAYFIELD_Y/2; j<TETRIS_PLAYFIELD_Y; j++) {
+                for (int i=0; i<TETRIS_PLAYFIELD_X; i++) {
+                        draw_block(st, i, j, g->playfield_colors[j][i], false);
+                }
+        }
+
+        // The shadow goes first so that the piece is drawn over it
+        draw_playfield_piece(g, st, g->current_shadow_location, true);
+        draw_playfield_piece(g, st, g->current_piece_location, false);
+}
+
+static void draw_nextarea(const struct tetris_game *g, struct point st, struct point ed) {
+        draw(st, ed, TETRIS_COLOR_BLACK);
+        frame_text(&frame, st.x+1, st.y+0, false, "Next");
+
+        if (g->paused) {
+                return;
+        }
+
+        int midx = st.x + (ed.x - st.x)/2;
+        int midy = st.y + (ed.y - st.y)/2;
+        int midy1 = st.y + (midy - st.y)/2;
+        int midy2 = midy;
+        int midy3 = midy + (ed.y - midy)/2;
+
+        struct point tst1, tst2, tst3;
         tst1.x = tst2.x = tst3.x = midx - 2;
         tst1.y = midy1 - 2;
         tst2.y = midy2 - 2;
         tst3.y = midy3 - 2;
 
-        draw_tetrimino(spawn_order[spawn_next_i], tst1);
-        draw_tetrimino(spawn_order[spawn_next_i+1], tst2);
-        draw_tetrimino(spawn_order[spawn_next_i+2], tst3);
+        draw_tetrimino(g->spawn_order[g->spawn_next_i], tst1);
+        draw_tetrimino(g->spawn_order[g->spawn_next_i+1], tst2);
+        draw_tetrimino(g->spawn_order[g->spawn_next_i+2], tst3);
+}
+
+static void draw_scorearea(const struct tetris_game *g, struct point st, struct point ed) {
+        char text[32];
+        draw(st, ed, TETRIS_COLOR_BLACK);
+
+        frame_text(&frame, st.x+1, st.y+0, false, "Score");
+        snprintf(text, sizeof(text), "%010ld", g->score);
+        frame_text(&frame, st.x+1, st.y+1, false, text);
+}
+
+static void draw_hiscorearea(struct point st, struct point ed, long shown_hiscore) {
+        char text[32];
+        draw(st, ed, TETRIS_COLOR_BLACK);
+
+        frame_text(&frame, st.x+1, st.y+0, false, "Hi-Score");
+        snprintf(text, sizeof(text), "%010ld", shown_hiscore);
+        frame_text(&frame, st.x+1, st.y+1, false, text);
+}
+
+static void draw_levelarea(const struct tetris_game *g, struct point st, struct point ed) {
+        char text[32];
+        draw(st, ed, TETRIS_COLOR_BLACK);
+        
+        frame_text(&frame, st.x+1, st.y+0, false, "Level");
+        snprintf(text, sizeof(text), "%10u", g->level);
+        frame_text(&frame, st.x+1, st.y+1, false, text);
+}
+
+static void draw_holdarea(const struct tetris_game *g, struct point st, struct point ed) {
+        draw(st, ed, TETRIS_COLOR_BLACK);
+        frame_text(&frame, st.x+1, st.y+0, false, "Hold");
+
+        if (g->paused) {
+                return;
+        }
+        
+        if (g->current_held_piece != TETRIMINO_TEST) {
+                struct point tst;
+                tst.x = st.x + (ed.x - st.x)/2 - 2;
+                tst.y = st.y + (ed.y - st.y)/2 - 2;
+                draw_tetrimino(g->current_held_piece, tst);
+        }
+}
+
+static void draw_controlsarea(struct point st, struct point ed, struct point text) {
+        draw(st, ed, TETRIS_COLOR_BLACK);
+
+        int i=0;
+        
+        frame_text(&frame, text.x + i, text.y, true, "x"); i++;
+        frame_text(&frame, text.x + i, text.y, false, "/"); i++;
+        frame_text(&frame, text.x + i, text.y, true, "z"); i++;
+        frame_text(&frame, text.x + i, text.y, false, ":rotate "); i+=strlen(":rotate ");
+        
+        frame_text(&frame, text.x + i, text.y, true, "c"); i++;
+        frame_text(&frame, text.x + i, text.y, false, ":hold "); i+=strlen(":hold ");
+        
+        frame_text(&frame, text.x + i, text.y, true, "p"); i++;
+        frame_text(&frame, text.x + i, text.y, false, ":pause "); i+=strlen(":pause ");
+        
+        frame_text(&frame, text.x + i, text.y, true, "q"); i++;
+        frame_text(&frame, text.x + i, text.y, false, ":quit");
+}
+
+static void draw_phase_overlay(struct point st) {
+        char text[8 + 3 * (1 + DURATION_TEXT_SIZE)]; // a name and three durations
+        snprintf(text, sizeof(text), "%-8s %8s %8s %8s", "phase", "p50", "p99", "max");
+        frame_text(&frame, st.x, st.y, true, text);
+        
+        for (int p=0; p<PHASE_COUNT; p++) {
+                const struct phase_histogram *h = &phase_histograms[p];
+                char p50[DURATION_TEXT_SIZE], p99[DURATION_TEXT_SIZE], max[DURATION_TEXT_SIZE];
+                format_duration(p50, phase_percentile_ns(h, 50));
+                format_duration(p99, phase_percentile_ns(h, 99));
+                format_duration(max, __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED));
+                snprintf(text, sizeof(text), "%-8s %8s %8s %8s", phase_names[p], p50, p99, max);
+                frame_text(&frame, st.x, st.y+1+p, false, text);
+        }
+}
+
+// Where everything goes on a terminal of the given size
+static void compute_layout(struct layout *l, struct point max) {
+        l->max = max;
+
+        // Blocks are two cells wide, or with half blocks half a cell tall,
+        // and only the bottom half of the playfield is visible
+        int width = half_blocks ? TETRIS_PLAYFIELD_X : TETRIS_PLAYFIELD_X*2;
+        int half_height = half_blocks ? TETRIS_PLAYFIELD_Y/4 : TETRIS_PLAYFIELD_Y/2;
+        
+        l->pf_st.x = max.x/2 - width/2;
+        l->pf_ed.x = l->pf_st.x + width;
+        
+        int pf_sty_visible = max.y/2 - half_height/2;
+        l->pf_st.y = pf_sty_visible - half_height;
+        l->pf_ed.y = pf_sty_visible + half_height;
+        l->pf_visible_st.x = l->pf_st.x;
+        l->pf_visible_st.y = pf_sty_visible;
+
+        l->sc_st.x = l->pf_ed.x + 3;
+        l->sc_ed.x = l->sc_st.x + SCORE_RECTANGLE_DRAW_X;
+        l->sc_st.y = pf_sty_visible;
+        l->sc_ed.y = l->sc_st.y + SCORE_RECTANGLE_DRAW_Y;
+
+        l->nx_st.x = l->sc_st.x;
+        l->nx_ed.x = l->nx_st.x + NEXT_RECTANGLE_DRAW_X;
+        l->nx_st.y = l->sc_ed.y + 2;
+        l->nx_ed.y = l->nx_st.y + (half_blocks ? NEXT_RECTANGLE_DRAW_Y_HALF_BLOCKS : NEXT_RECTANGLE_DRAW_Y);
+
+        l->hd_ed.x = l->pf_st.x - 3;
+        l->hd_st.x = l->hd_ed.x - HOLD_RECTANGLE_DRAW_X;
+        l->hd_st.y = pf_sty_visible;
+        l->hd_ed.y = l->hd_st.y + (half_blocks ? HOLD_RECTANGLE_DRAW_Y_HALF_BLOCKS : HOLD_RECTANGLE_DRAW_Y);
+
+        l->hs_st.x = l->hd_st.x;
+        l->hs_ed.x = l->hs_st.x + SCORE_RECTANGLE_DRAW_X;
+        l->hs_ed.y = l->pf_ed.y;
+        l->hs_st.y = l->hs_ed.y - SCORE_RECTANGLE_DRAW_Y;
+
+        l->cs_st.x = l->hd_st.x;
+        l->cs_ed.x = l->nx_ed.x;
+        l->cs_st.y = l->pf_ed.y + 1;
+        l->cs_ed.y = l->cs_st.y + 1;
+        
+        int msglen = 32; // x/z:rotate c:hold p:pause q:quit
+        l->cs_text.x = l->cs_st.x + (l->cs_ed.x - l->cs_st.x - msglen)/2;
+        l->cs_text.y = l->cs_st.y;
+
+        l->lv_st.x = l->hs_st.x;
+        l->lv_ed.x = l->lv_st.x + LEVEL_RECTANGLE_DRAW_X;
+        l->lv_ed.y = l->hs_st.y - 2;
+        l->lv_st.y = l->lv_ed.y - LEVEL_RECTANGLE_DRAW_Y;
+
+        l->go_st.x = max.x/2 - GAMEOVER_RECTANGLE_DRAW_X/2;
+        l->go_ed.x = max.x/2 + GAMEOVER_RECTANGLE_DRAW_X/2;
+        l->go_st.y = max.y/2 - GAMEOVER_RECTANGLE_DRAW_Y/2;
+        l->go_ed.y = max.y/2 + GAMEOVER_RECTANGLE_DRAW_Y/2;
+
+        int textlen = sizeof(GAMEOVER_TEXT) - 1;
+        l->go_text.x = l->go_st.x + (l->go_ed.x - l->go_st.x)/2 - textlen/2;
+        l->go_text.y = l->go_st.y + (l->go_ed.y - l->go_st.y)/2;
+
+        // Under the controls, or over the top left corner if there's no room
+        l->ov_st.x = l->cs_st.x;
+        l->ov_st.y = l->cs_ed.y;
+        if (l->ov_st.y + PHASE_COUNT+1 > max.y)
+                l->ov_st.x = l->ov_st.y = 0;
+}
+
+// Lay out the screen for the current terminal size and send all of it on
+// the next frame
+static void setup_screen(void) {
+        struct point max;
+        getmaxyx(stdscr, max.y, max.x); // it's a macro
+        
+        compute_layout(&layout, max);
+        frame_resize(&frame, max.x, max.y);
+        frame_resize(&shown_frame, max.x, max.y);
+        frame_invalidate(&shown_frame);
+        if (render_backend == RENDER_ANSI)
+                ansi_resize(&ansi, max.x, max.y);
+}
+
+static void draw_screen(const struct tetris_game *g, long shown_hiscore) {
+        const struct layout *l = &layout;
+        
+        draw_background(l->max);
+        draw_playfield(g, l->pf_st, l->pf_visible_st, l->pf_ed);
+        draw_nextarea(g, l->nx_st, l->nx_ed);
+        draw_scorearea(g, l->sc_st, l->sc_ed);
+        draw_hiscorearea(l->hs_st, l->hs_ed, shown_hiscore);
+        draw_holdarea(g, l->hd_st, l->hd_ed);
+        draw_controlsarea(l->cs_st, l->cs_ed, l->cs_text);
+        draw_levelarea(g, l->lv_st, l->lv_ed);
+}
+
+static void draw_gameover_screen(void) {
+        struct point st = layout.go_st;
+        
+        draw(st, layout.go_ed, TETRIS_COLOR_BLACK);
+
+        struct point st1, ed1;
+        st1.x = st.x + 1;
+        st1.y = st.y + 1;
+        ed1.x = st.x - 1;
+        ed1.y = st.y - 1;
+        
+        draw(st1, ed1, TETRIS_COLOR_RED);
+
+        struct point st2, ed2;
+        st2.x = st.x + 2;
+        st2.y = st.y + 2;
+        ed2.x = st.x - 2;
+        ed2.y = st.y - 2;
+        
+        draw(st2, ed2, TETRIS_COLOR_BLACK);
+
+        frame_text(&frame, layout.go_text.x, layout.go_text.y, false, GAMEOVER_TEXT);
+}
+
+static void draw_gameover(const struct tetris_game *g, long shown_hiscore) {
+        draw_screen(g, shown_hiscore);
+        draw_gameover_screen();
+}
+
+
+
+// Snapshot functions
+
+static struct snapshot *snapshot_back(struct snapshot_buffer *b) {
+        return &b->slots[b->back];
+}
+
+// Make the back slot the latest snapshot
+static void snapshot_publish(struct snapshot_buffer *b) {
+        unsigned old = __atomic_exchange_n(&b->middle, b->back | SNAPSHOT_FRESH, __ATOMIC_ACQ_REL);
+        b->back = old & ~SNAPSHOT_FRESH;
+}
+
+// The latest snapshot, which stays put until the next call
+static const struct snapshot *snapshot_latest(struct snapshot_buffer *b) {
+        if (__atomic_load_n(&b->middle, __ATOMIC_RELAXED) & SNAPSHOT_FRESH) {
+                unsigned old = __atomic_exchange_n(&b->middle, b->front, __ATOMIC_ACQ_REL);
+                b->front = old & ~SNAPSHOT_FRESH;
+        }
+        return &b->slots[b->front];
+}
+
+
+
+// Replay functions
+
+// Seven bits at a time, lowest first, the top bit set on all but the last
+static void replay_put_varint(FILE *f, uint64_t v) {
+        while (v >= 0x80) {
+                putc((int)(v & 0x7f) | 0x80, f);
+                v >>= 7;
+        }
+        putc((int)v, f);
+}
+
+static bool replay_get_varint(FILE *f, uint64_t *v) {
+        *v = 0;
+        for (int shift=0; shift<64; shift+=7) {
+                int c = getc(f);
+                if (c == EOF)
+                        return false;
+                *v |= (uint64_t)(c & 0x7f) << shift;
+                if (!(c & 0x80))
+                        return true;
+        }
+        return false;
+}
+
+static void replay_start(struct replay_recorder *r, FILE *f, uint64_t seed, enum tetris_rotation_system system) {
+        memset(r, 0, sizeof(*r));
+        r->f = f;
+        fputs(REPLAY_MAGIC, f);
+        replay_put_varint(f, REPLAY_VERSION);
+        for (int i=0; i<8; i++)
+                putc((int)(seed >> (i * 8) & 0xff), f);
+        replay_put_varint(f, system);
+}
+
+static void replay_tick(struct replay_recorder *r, const struct tetris_game *g) {
+        if (r->f != NULL && !g->paused && !g->game_over)
+                r->ticks++;
+}
+
+static void replay_input(struct replay_recorder *r, enum input_type t) {
+        if (r->f == NULL)
+                return;
+        replay_put_varint(r->f, (r->ticks - r->last_event_tick) << REPLAY_INPUT_BITS | t);
+        r->last_event_tick = r->ticks;
+}
+
+static void replay_end(struct replay_recorder *r) {
+        if (r->f == NULL)
+                return;
+        replay_input(r, INPUT_NONE);
+        fflush(r->f);
+}
+
+static void finish_recording(void) {
+        replay_end(&recorder);
+        fclose(recorder.f);
+        recorder.f = NULL;
+}
+
+// Plays a whole replay back into g. Replays of every version so far are
+// read, but one only plays out the same on the engine it was recorded
+// with: if any input isn't taken, this isn't it. Version 1 also recorded
+// moves into a wall and rotations that didn't fit, so there nothing is
+// refused. Returns false if f isn't a replay, or isn't one that plays out
+// the same.
+static bool replay_play(FILE *f, struct tetris_game *g, uint64_t *ticks) {
+        char magic[sizeof(REPLAY_MAGIC) - 1];
+        uint64_t version, system, v;
+        uint64_t seed = 0;
+        if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, REPLAY_MAGIC, sizeof(magic)) != 0 ||
+            !replay_get_varint(f, &version) || version < 1 || version > REPLAY_VERSION)
+                return false;
+        for (int i=0; i<8; i++) {
+                int c = getc(f);
+                if (c == EOF)
+                        return false;
+                seed |= (uint64_t)c << (i * 8);
+        }
+        if (!replay_get_varint(f, &system) || system > TETRIS_ROTATION_ARS)
+                return false;
+        
+        tetris_game_init(g, seed);
+        tetris_game_set_rotation_system(g, system);
+        *ticks = 0;
+        
+        // One that was cut short plays up to where it was cut
+        while (replay_get_varint(f, &v)) {
+                enum input_type t = v & ((1 << REPLAY_INPUT_BITS) - 1);
+                if (t > INPUT_EXIT)
+                        return false;
+                for (uint64_t i=0; i < v >> REPLAY_INPUT_BITS; i++)
+                        tetris_game_tick(g);
+                *ticks += v >> REPLAY_INPUT_BITS;
+                if (t == INPUT_NONE)
+                        break;
+                if (!tetris_game_input(g, t) && version >= 2)
+                        return false;
+        }
+        return true;
+}
+
+static int print_replay(const char *filename) {
+        FILE *f = fopen(filename, "rb");
+        if (f == NULL) {
+                perror(filename);
+                return EXIT_FAILURE;
+        }
+        struct tetris_game g;
+        uint64_t ticks;
+        bool played_out = replay_play(f, &g, &ticks);
+        fclose(f);
+        if (!played_out) {
+                fprintf(stderr, "%s is not a replay of this game.\n", filename);
+                return EXIT_FAILURE;
+        }
+
+        long s = ticks * TETRIS_TICK_US / 1000000;
+        printf("score %ld, %d lines, level %u after %ld:%02ld%s\n", g.score, g.lines, g.level,
+               s / 60, s % 60, tetris_game_is_over(&g) ? ", game over" : "");
+        return EXIT_SUCCESS;
+}
+
+// Every input the player gets in goes through here, to be recorded
+static bool game_input(struct tetris_game *g, enum input_type t) {
+        if (!tetris_game_input(g, t))
+                return false;
+        replay_input(&recorder, t);
+        return true;
+}
+
+
+
+// Input functions
+
+static enum input_type get_player_input(int c) {
+        switch(c) {
+        case ERR:
+                return INPUT_NONE;
+                
+        case KEY_UP:
+        case 'X':
+        case 'x':
+                return INPUT_CLOCKWISE_ROTATION;
+
+        case ' ':
+                return INPUT_HARD_DROP;
+
+        case 'C':
+        case 'c':
+                return INPUT_HOLD;
+
+        case 'Z':
+        case 'z':
+                return INPUT_COUNTERCLOCKWISE_ROTATION;
+
+        case KEY_DOWN:
+                return INPUT_SOFT_DROP;
+
+        case KEY_LEFT:
+                return INPUT_LEFT;
+
+        case KEY_RIGHT:
+                return INPUT_RIGHT;
+                
+        case 'P':
+        case 'p':
+                return INPUT_PAUSE;
+
+        case 'Q':
+        case 'q':
+                return INPUT_EXIT;
+
+        default:
+                return INPUT_NONE;
+        }
+}
+
+static long now_us(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void handle_sigwinch(int sig) {
+        (void)sig;
+        terminal_resized = true;
+}
+
+// The terminal went away, or we're asked to stop: leave like on a quit, so
+// that the game gets saved
+static void handle_quit_signal(int sig) {
+        (void)sig;
+        quit_requested = true;
+}
+
+static void handle_resize(void) {
+        struct winsize ws;
+        terminal_resized = false;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+                resizeterm(ws.ws_row, ws.ws_col);
+                clearok(curscr, TRUE); // whatever was on screen is garbage now
+                setup_screen();
+        }
+}
+
+// Ask for every key as an escape code with its press, repeat and release
+// (flags 1, 2 and 8), and whether the terminal supports it at all. Those
+// that don't should ignore both, and then we never get an answer.
+static void enable_kitty_keyboard(void) {
+        static const char request[] = "\x1b[>11u\x1b[?u";
+        if (write(STDOUT_FILENO, request, sizeof(request) - 1) == -1)
+                perror("write");
+}
+
+static void terminal_input_read(struct terminal_input *in) {
+        ssize_t n = read(STDIN_FILENO, in->buf + in->len, sizeof(in->buf) - in->len);
+        if (n > 0)
+                in->len += n;
+}
+
+static void terminal_input_consume(struct terminal_input *in, int n) {
+        in->len -= n;
+        memmove(in->buf, in->buf + n, in->len);
+}
+
+static int arrow_key(unsigned char c) {
+        switch (c) {
+        case 'A':
+                return KEY_UP;
+        case 'B':
+                return KEY_DOWN;
+        case 'C':
+                return KEY_RIGHT;
+        case 'D':
+                return KEY_LEFT;
+        default:
+                return ERR;
+        }
+}
+
+// Take the next whole key event out of the buffer, false if there isn't one
+// yet. Understands plain bytes, the usual arrow key sequences, and kitty's
+// CSI key;modifiers:event u and CSI 1;modifiers:event A-D.
+static bool terminal_input_next(struct terminal_input *in, struct key_event *ev) {
+        while (in->len > 0) {
+                if (in->buf[0] != 0x1b) {
+                        ev->key = in->buf[0];
+                        ev->type = KEY_EVENT_PRESS;
+                        terminal_input_consume(in, 1);
+                        return true;
+                }
+
+                if (in->len < 2)
+                        return false;
+                
+                if (in->buf[1] == 'O') {
+                        if (in->len < 3)
+                                return false;
+                        ev->key = arrow_key(in->buf[2]);
+                        ev->type = KEY_EVENT_PRESS;
+                        terminal_input_consume(in, 3);
+                        if (ev->key != ERR)
+                                return true;
+                        continue;
+                }
+                
+                if (in->buf[1] != '[') {
+                        // A lone escape, nothing we use
+                        terminal_input_consume(in, 1);
+                        continue;
+                }
+
+                int end = 2;
+                while (end < in->len && (in->buf[end] < 0x40 || in->buf[end] > 0x7e))
+                        end++;
+                if (end == in->len) {
+                        if (in->len == sizeof(in->buf))
+                                in->len = 0;
+                        return false;
+                }
+
+                // Up to two ; separated parameters, the event type is after
+                // a : in the second one
+                char private = 0;
+                int i = 2;
+                if (strchr("<=>?", in->buf[i]) != NULL)
+                        private = in->buf[i++];
+                long params[2] = {1, 1};
+                int event = 1;
+                for (int p=0; p<2 && i<end; p++) {
+                        if (in->buf[i] >= '0' && in->buf[i] <= '9')
+                                params[p] = 0;
+                        while (i < end && in->buf[i] >= '0' && in->buf[i] <= '9')
+                                params[p] = params[p] * 10 + (in->buf[i++] - '0');
+                        if (p == 1 && i < end && in->buf[i] == ':')
+                                event = in->buf[++i] - '0';
+                        while (i < end && in->buf[i] != ';')
+                                i++;
+                        i++;
+                }
+                unsigned char final = in->buf[end];
+                terminal_input_consume(in, end + 1);
+
+                if (private == '?' && final == 'u') {
+                        in->kitty = true;
+                        continue;
+                }
+                if (private != 0)
+                        continue;
+
+                if (final == 'u')
+                        ev->key = params[0];
+                else
+                        ev->key = arrow_key(final);
+                if (ev->key == ERR)
+                        continue;
+                
+                if (event == 2)
+                        ev->type = KEY_EVENT_REPEAT;
+                else if (event == 3)
+                        ev->type = KEY_EVENT_RELEASE;
+                else
+                        ev->type = KEY_EVENT_PRESS;
+                return true;
+        }
+
+        return false;
+}
+
+static void press_action(struct tetris_game *g, enum input_type t, long now) {
+        struct held_action *h = &held_actions[t];
+        if (!h->held || now - h->last_seen_us >= LEGACY_HOLD_GAP_US)
+                h->held_since_us = now;
+        h->held = true;
+        h->repeating = terminal.kitty;
+        h->last_seen_us = now;
+        // The press itself counts as the first move, so with no DAS the
+        // next one is an ARR away
+        const struct action_timing *timing = &action_timings[t];
+        h->next_repeat_us = now + (timing->das_us > 0 ? timing->das_us : timing->arr_us);
+        
+        game_input(g, t);
+}
+
+static void handle_key_event(struct tetris_game *g, const struct key_event *ev, long now) {
+        if (ev->key == PHASE_OVERLAY_KEY) {
+                if (ev->type == KEY_EVENT_PRESS)
+                        show_phase_overlay = !show_phase_overlay;
+                return;
+        }
+        
+        enum input_type t = get_player_input(ev->key);
+        if (t == INPUT_NONE)
+                return;
+        
+        if (t == INPUT_EXIT) {
+                if (ev->type == KEY_EVENT_PRESS)
+                        exit(EXIT_SUCCESS);
+                return;
+        }
+
+        struct held_action *h = &held_actions[t];
+        switch (ev->type) {
+        case KEY_EVENT_PRESS:
+                // Without releases, presses that have kept coming quickly
+                // for longer than the terminal's repeat delay are it
+                // repeating a held key. That delay stood in for our DAS, so
+                // we repeat from now. Until then each one is a tap of its own.
+                if (!terminal.kitty && action_timings[t].das_us >= 0 &&
+                    h->held && now - h->last_seen_us < LEGACY_HOLD_GAP_US &&
+                    now - h->held_since_us >= LEGACY_REPEAT_DELAY_US) {
+                        h->last_seen_us = now;
+                        if (!h->repeating) {
+                                h->repeating = true;
+                                h->next_repeat_us = now;
+                        }
+                } else {
+                        press_action(g, t, now);
+                }
+                break;
+
+        case KEY_EVENT_REPEAT:
+                // We time the repeats ourselves
+                h->last_seen_us = now;
+                break;
+
+        case KEY_EVENT_RELEASE:
+                h->held = false;
+                break;
+        }
+}
+
+// Auto repeat the actions whose keys are held down
+static void update_held_actions(struct tetris_game *g, long now) {
+        for (int t=0; t<=INPUT_EXIT; t++) {
+                struct held_action *h = &held_actions[t];
+                const struct action_timing *timing = &action_timings[t];
+                if (!h->held || timing->das_us < 0)
+                        continue;
+                
+                if (!terminal.kitty && now - h->last_seen_us >= LEGACY_HOLD_GAP_US) {
+                        h->held = false;
+                        continue;
+                }
+                if (!h->repeating)
+                        continue;
+                
+                // All the way, which stops with the first input that doesn't
+                // move the piece, so one held against the wall costs one
+                // refused input per wake and records nothing
+                if (timing->arr_us == 0) {
+                        if (now >= h->next_repeat_us)
+                                for (int i=0; i<TETRIS_PLAYFIELD_Y && game_input(g, t); i++)
+                                        ;
+                        continue;
+                }
+                while (now >= h->next_repeat_us) {
+                        game_input(g, t);
+                        h->next_repeat_us += timing->arr_us;
+                }
+        }
+}
+
+// When update_held_actions() will next have something to do, -1 if never.
+// Actions with an ARR of 0 run on every wake up once their DAS is over.
+static long next_held_action_us(long now) {
+        long next = -1;
+        for (int t=0; t<=INPUT_EXIT; t++) {
+                const struct held_action *h = &held_actions[t];
+                if (!h->held || action_timings[t].das_us < 0)
+                        continue;
+
+                long deadline = -1;
+                if (h->repeating && (action_timings[t].arr_us > 0 || now < h->next_repeat_us))
+                        deadline = h->next_repeat_us;
+                if (!terminal.kitty && (deadline == -1 || h->last_seen_us + LEGACY_HOLD_GAP_US < deadline))
+                        deadline = h->last_seen_us + LEGACY_HOLD_GAP_US;
+                
+                if (deadline != -1 && (next == -1 || deadline < next))
+                        next = deadline;
+        }
+        return next;
+}
+
+static void process_input(struct tetris_game *g) {
+        long now = now_us();
+        struct key_event ev;
+        
+        terminal_input_read(&terminal);
+        while (terminal_input_next(&terminal, &ev))
+                handle_key_event(g, &ev, now);
+        update_held_actions(g, now);
+}
+
+// Parses --timing=ACTION:DAS:ARR, or --timing=ACTION:off, in milliseconds
+static bool parse_timing(const char *arg) {
+        char name[16];
+        long das, arr;
+        int n;
+        
+        if (sscanf(arg, "--timing=%15[a-z-]:%n", name, &n) != 1)
+                return false;
+
+        for (int t=0; t<=INPUT_EXIT; t++) {
+                if (action_names[t] == NULL || strcmp(action_names[t], name) != 0)
+                        continue;
+
+                if (strcmp(arg + n, "off") == 0) {
+                        action_timings[t].das_us = -1;
+                        return true;
+                }
+                if (sscanf(arg + n, "%ld:%ld", &das, &arr) != 2 || das < 0 || arr < 0)
+                        return false;
+                action_timings[t].das_us = das * 1000;
+                action_timings[t].arr_us = arr * 1000;
+                return true;
+        }
+        
+        return false;
+}
+
+
+
+// Hiscore functions
+
+// Path of one of our files under the XDG data directory
+static bool get_data_filename(char *result, size_t maxsize, const char *name) {
+        const char *base = getenv("XDG_DATA_HOME");
+        if (base == NULL) {
+                const char *home = getenv("HOME");
+                if (home == NULL) {
+                        return false;
+                }
+
+                if (!mystrncpy(&result, home, &maxsize)) {
+                        return false;
+                }
+                if (!mystrncpy(&result, "/.local/share", &maxsize)) {
+                        return false;
+                }
+        } else {
+                if (!mystrncpy(&result, base, &maxsize)) {
+                        return false;
+                }
+        }
+
+        if (!mystrncpy(&result, "/", &maxsize) || !mystrncpy(&result, name, &maxsize) || maxsize == 0) {
+                return false;
+        }
+        *result = '\0';
+        return true;
 }
 
-static void draw_scorearea(struct point st, struct point ed) {
-        draw(st, ed, TETRIS_COLOR_BLACK);
+// The leaderboard file is only ever replaced whole with rename(), so it can
+// be read at any time without a lock. A file that isn't there reads as an
+// empty leaderboard. Returns false if it can't be read or isn't one.
+static bool leaderboard_read(const char *filename, struct leaderboard *lb) {
+        memset(lb, 0, sizeof(*lb));
+        lb->magic = LEADERBOARD_MAGIC;
+        lb->version = LEADERBOARD_VERSION;
+        
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return errno == ENOENT;
 
-        mvprintw(st.y+0, st.x+1, "Score");
-        mvprintw(st.y+1, st.x+1, "%010ld", score);
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size != sizeof(*lb)) {
+                close(fd);
+                return false;
+        }
+        struct leaderboard *mapped = mmap(NULL, sizeof(*lb), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+                return false;
+        
+        bool valid = mapped->magic == LEADERBOARD_MAGIC && mapped->version == LEADERBOARD_VERSION &&
+                mapped->count <= LEADERBOARD_ENTRIES;
+        if (valid)
+                memcpy(lb, mapped, sizeof(*lb));
+        munmap(mapped, sizeof(*lb));
+        return valid;
 }
 
-static void draw_hiscorearea(struct point st, struct point ed) {
-        draw(st, ed, TETRIS_COLOR_BLACK);
+// Puts e in its place, after any games with the same score. Returns false
+// if it isn't good enough to make it.
+static bool leaderboard_insert(struct leaderboard *lb, const struct game_record *e) {
+        uint32_t i = lb->count;
+        while (i > 0 && lb->entries[i-1].score < e->score)
+                i--;
+        if (i >= LEADERBOARD_ENTRIES)
+                return false;
 
-        mvprintw(st.y+0, st.x+1, "Hi-Score");
-        mvprintw(st.y+1, st.x+1, "%010ld", hiscore);
+        uint32_t last = lb->count < LEADERBOARD_ENTRIES ? lb->count : LEADERBOARD_ENTRIES - 1;
+        memmove(&lb->entries[i+1], &lb->entries[i], (last - i) * sizeof(*e));
+        lb->entries[i] = *e;
+        if (lb->count < LEADERBOARD_ENTRIES)
+                lb->count++;
+        return true;
 }
 
-static void draw_levelarea(struct point st, struct point ed) {
-        draw(st, ed, TETRIS_COLOR_BLACK);
+// A file's name is only on disk once the directory it was created or
+// renamed in has been synced as well
+static bool sync_directory_of(const char *filename) {
+        static char directory[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        const char *slash = strrchr(filename, '/');
+        size_t len = slash != NULL ? (size_t)(slash - filename) : 0;
+        if (len >= sizeof(directory))
+                return false;
+        memcpy(directory, filename, len);
+        directory[len] = '\0';
         
-        mvprintw(st.y+0, st.x+1, "Level");
-        mvprintw(st.y+1, st.x+1, "%10d", level);
+        int fd = open(slash == NULL ? "." : len == 0 ? "/" : directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        bool synced = fd != -1 && fsync(fd) == 0;
+        if (fd != -1)
+                close(fd);
+        return synced;
 }
 
-static void draw_holdarea(struct point st, struct point ed) {
-        draw(st, ed, TETRIS_COLOR_BLACK);
-        mvprintw(st.y+0, st.x+1, "Hold");
+// Written to a temporary file first and renamed over filename, so that
+// anyone reading it sees either all of the old file or all of the new one
+static bool replace_file(const char *filename, const struct iovec *iov, int iovcnt) {
+        static char temp_filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH + 4];
+        snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
 
-        if (paused) {
-                return;
-        }
+        ssize_t size = 0;
+        for (int i=0; i<iovcnt; i++)
+                size += iov[i].iov_len;
         
-        if (current_held_piece != TETRIMINO_TEST) {
-                struct point tst;
-                tst.x = st.x + (ed.x - st.x)/2 - 2;
-                tst.y = st.y + (ed.y - st.y)/2 - 2;
-                draw_tetrimino(current_held_piece, tst);
+        int fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        bool written = fd != -1 && writev(fd, iov, iovcnt) == size && fsync(fd) == 0;
+        if (fd != -1)
+                close(fd);
+        if (!written || rename(temp_filename, filename) == -1) {
+                unlink(temp_filename);
+                return false;
         }
+        return sync_directory_of(filename);
 }
 
-static void draw_controlsarea(struct point st, struct point ed) {
-        int msglen = 32; // x/z:rotate c:hold p:pause q:quit
-        int total_space = ed.x-st.x;
-        int spare_space = total_space - msglen;
-        int margin = spare_space / 2;
-                
-        draw(st, ed, TETRIS_COLOR_BLACK);
-
-        int i=0;
-        
-        attron(A_BOLD);
-        mvaddch(st.y, st.x + margin + i, 'x'); i++;
-        attroff(A_BOLD);
-        
-        mvaddch(st.y, st.x + margin + i, '/'); i++;
-        
-        attron(A_BOLD);
-        mvaddch(st.y, st.x + margin + i, 'z'); i++;
-        attroff(A_BOLD);
-        
-        mvprintw(st.y, st.x + margin + i, ":rotate "); i+=strlen(":rotate ");
-        
-        attron(A_BOLD);
-        mvaddch(st.y, st.x + margin + i, 'c'); i++;
-        attroff(A_BOLD);
-        
-        mvprintw(st.y, st.x + margin + i, ":hold "); i+=strlen(":hold ");
-        
-        attron(A_BOLD);
-        mvaddch(st.y, st.x + margin + i, 'p'); i++;
-        attroff(A_BOLD);
-        
-        mvprintw(st.y, st.x + margin + i, ":pause "); i+=strlen(":pause ");
-        
-        attron(A_BOLD);
-        mvaddch(st.y, st.x + margin + i, 'q'); i++;
-        attroff(A_BOLD);
+// Every update of the saved games happens while holding a lock on a file of
+// its own, which stays put when the files themselves are renamed over.
+// Updates take it with LOCK_EX, reads that need a consistent view of more
+// than one file with LOCK_SH. Returns the lock to give to unlock_data(),
+// or -1.
+static int lock_data(int operation) {
+        static char lock_filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        if (!get_data_filename(lock_filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, DATA_LOCK_FILE) ||
+            !make_directory_exist(lock_filename)) {
+                fprintf(stderr, "Could not determine the path of the saved games.\n");
+                return -1;
+        }
         
-        mvprintw(st.y, st.x + margin + i, ":quit "); i+=strlen(":quit");
+        int lock = open(lock_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (lock == -1 || flock(lock, operation) == -1) {
+                perror("Could not lock the saved games");
+                if (lock != -1)
+                        close(lock);
+                return -1;
+        }
+        return lock;
 }
 
-static void draw_screen(void) {
-        struct point max;
-        getmaxyx(stdscr, max.y, max.x); // it's a macro
-        
-        // center horizontally as if it was double its actual width
-        struct point pf_st, pf_ed;
-        pf_st.x = max.x/2 - TETRIS_PLAYFIELD_X;
-        pf_ed.x = max.x/2 + TETRIS_PLAYFIELD_X;
-        
-        // center vertically as if it was half its actual length
-        pf_st.y = max.y/2 - TETRIS_PLAYFIELD_Y/2 - TETRIS_PLAYFIELD_Y/4;
-        pf_ed.y = max.y/2 + TETRIS_PLAYFIELD_Y/2 - TETRIS_PLAYFIELD_Y/4;
-        
-        int pf_sty_visible = pf_st.y + TETRIS_PLAYFIELD_Y/2;
-
-        struct point sc_st, sc_ed;
-        sc_st.x = pf_ed.x + 3;
-        sc_ed.x = sc_st.x + SCORE_RECTANGLE_DRAW_X;
-        sc_st.y = pf_sty_visible;
-        sc_ed.y = sc_st.y + SCORE_RECTANGLE_DRAW_Y;
-
-        struct point nx_st, nx_ed;
-        nx_st.x = sc_st.x;
-        nx_ed.x = nx_st.x + NEXT_RECTANGLE_DRAW_X;
-        nx_st.y = sc_ed.y + 2;
-        nx_ed.y = nx_st.y + NEXT_RECTANGLE_DRAW_Y;
-
-        struct point hd_st, hd_ed;
-        hd_ed.x = pf_st.x - 3;
-        hd_st.x = hd_ed.x - HOLD_RECTANGLE_DRAW_X;
-        hd_st.y = pf_sty_visible;
-        hd_ed.y = hd_st.y + HOLD_RECTANGLE_DRAW_Y;
-
-        struct point hs_st, hs_ed;
-        hs_st.x = hd_st.x;
-        hs_ed.x = hs_st.x + SCORE_RECTANGLE_DRAW_X;
-        hs_ed.y = pf_ed.y;
-        hs_st.y = hs_ed.y - SCORE_RECTANGLE_DRAW_Y;
-
-        struct point cs_st, cs_ed;
-        cs_st.x = hd_st.x;
-        cs_ed.x = nx_ed.x;
-        cs_st.y = pf_ed.y + 1;
-        cs_ed.y = cs_st.y + 1;
-
-        struct point lv_st, lv_ed;
-        lv_st.x = hs_st.x;
-        lv_ed.x = lv_st.x + LEVEL_RECTANGLE_DRAW_X;
-        lv_ed.y = hs_st.y - 2;
-        lv_st.y = lv_ed.y - LEVEL_RECTANGLE_DRAW_Y;
-        
-        draw_background(max);
-        draw_playfield(pf_st, pf_ed);
-        draw_nextarea(nx_st, nx_ed);
-        draw_scorearea(sc_st, sc_ed);
-        draw_hiscorearea(hs_st, hs_ed);
-        draw_holdarea(hd_st, hd_ed);
-        draw_controlsarea(cs_st, cs_ed);
-        draw_levelarea(lv_st, lv_ed);
+static void unlock_data(int lock) {
+        close(lock);
 }
 
-static void draw_gameover_screen(void) {
-        struct point max;
-        getmaxyx(stdscr, max.y, max.x);
-
-        struct point st, ed;
-        st.x = max.x/2 - GAMEOVER_RECTANGLE_DRAW_X/2;
-        ed.x = max.x/2 + GAMEOVER_RECTANGLE_DRAW_X/2;
-
-        st.y = max.y/2 - GAMEOVER_RECTANGLE_DRAW_Y/2;
-        ed.y = max.y/2 + GAMEOVER_RECTANGLE_DRAW_Y/2;
-
-        draw(st, ed, TETRIS_COLOR_BLACK);
-
-        struct point st1, ed1;
-        st1.x = st.x + 1;
-        st1.y = st.y + 1;
-        ed1.x = st.x - 1;
-        ed1.y = st.y - 1;
-        
-        draw(st1, ed1, TETRIS_COLOR_RED);
+// Only while holding the lock
+static bool leaderboard_add(const struct game_record *e) {
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, LEADERBOARD_FILE)) {
+                fprintf(stderr, "Leaderboard was not saved: Could not determine path.\n");
+                return false;
+        }
 
-        struct point st2, ed2;
-        st2.x = st.x + 2;
-        st2.y = st.y + 2;
-        ed2.x = st.x - 2;
-        ed2.y = st.y - 2;
+        struct leaderboard lb;
+        if (!leaderboard_read(filename, &lb)) {
+                fprintf(stderr, "Leaderboard was not saved: %s is not a leaderboard.\n", filename);
+                return false;
+        }
+        if (!leaderboard_insert(&lb, e))
+                return true;
         
-        draw(st2, ed2, TETRIS_COLOR_BLACK);
+        struct iovec iov = {&lb, sizeof(lb)};
+        if (!replace_file(filename, &iov, 1)) {
+                perror("Leaderboard was not saved");
+                return false;
+        }
+        return true;
+}
 
-        static const char text[] = "GAME OVER";
-        static const unsigned textlen = sizeof(text) - 1;
+// Compared by qsort(), which can't be handed them
+static const struct game_record *sorting_records;
 
-        struct point t;
-        t.x = st.x + (ed.x - st.x)/2 - textlen/2;
-        t.y = st.y + (ed.y - st.y)/2;
-        mvprintw(t.y, t.x, text);
+static int compare_record_numbers(int64_t a, int64_t b, uint32_t i, uint32_t j) {
+        if (a != b)
+                return a < b ? -1 : 1;
+        return i < j ? -1 : i > j;
 }
 
-static void draw_gameover(void) {
-        draw_screen();
-        draw_gameover_screen();
+static int compare_by_score(const void *a, const void *b) {
+        uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+        return compare_record_numbers(sorting_records[i].score, sorting_records[j].score, i, j);
 }
 
+// a is sorted up to sorted, sort the rest and merge it in from the back.
+// The index is short of less than an interval's worth of games, unless it
+// was lost, so that's all there is to sort.
+static void merge_sorted_tail(uint32_t *a, uint32_t sorted, uint32_t count, int (*compare)(const void *, const void *)) {
+        uint32_t tail_count = count - sorted;
+        qsort(a + sorted, tail_count, sizeof(uint32_t), compare);
+        
+        uint32_t *tail = malloc(tail_count * sizeof(uint32_t));
+        if (tail == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(tail, a + sorted, tail_count * sizeof(uint32_t));
+        
+        uint32_t i = sorted, j = tail_count, k = count;
+        while (j > 0) {
+                if (i > 0 && compare(&a[i-1], &tail[j-1]) > 0)
+                        a[--k] = a[--i];
+                else
+                        a[--k] = tail[--j];
+        }
+        free(tail);
+}
 
+// Bring the index in memory up to date with the records, if it isn't.
+// Returns true if it changed.
+static bool history_index_update(struct history *h) {
+        struct history_index_header *x = &h->header;
+        if (x->count == h->count)
+                return false;
+        uint32_t sorted = x->count;
+        
+        uint32_t *by_score = realloc(h->by_score, h->count * sizeof(uint32_t));
+        if (by_score == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+        }
+        h->by_score = by_score;
+        
+        for (uint32_t i=x->count; i<h->count; i++) {
+                const struct game_record *r = &h->records[i];
+                x->total_score += r->score;
+                x->total_lines += r->lines;
+                x->total_levels += r->level;
+                x->total_duration_s += r->duration_s;
+                if (r->lines > x->best_lines)
+                        x->best_lines = r->lines;
+                if (r->level > x->best_level)
+                        x->best_level = r->level;
+                if (r->duration_s > x->longest_s)
+                        x->longest_s = r->duration_s;
+                h->by_score[i] = i;
+        }
+        x->count = h->count;
 
-// Input functions
-
-static enum input_type get_player_input(int c) {
-        switch(c) {
-        case ERR:
-                return INPUT_NONE;
-                
-        case KEY_UP:
-        case 'X':
-        case 'x':
-                return INPUT_CLOCKWISE_ROTATION;
-
-        case ' ':
-                return INPUT_HARD_DROP;
+        sorting_records = h->records;
+        merge_sorted_tail(h->by_score, sorted, h->count, compare_by_score);
+        return true;
+}
 
-        case 'C':
-        case 'c':
-                return INPUT_HOLD;
+static void history_index_reset(struct history_index_header *x) {
+        memset(x, 0, sizeof(*x));
+        x->magic = HISTORY_INDEX_MAGIC;
+        x->version = HISTORY_INDEX_VERSION;
+}
 
-        case 'Z':
-        case 'z':
-                return INPUT_COUNTERCLOCKWISE_ROTATION;
+// The index as it's saved, or an empty one if it's missing, or doesn't
+// match the records
+static void history_index_read(struct history *h, const char *filename) {
+        history_index_reset(&h->header);
+        
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return;
 
-        case KEY_DOWN:
-                return INPUT_SOFT_DROP;
+        struct history_index_header x;
+        struct stat st;
+        bool valid = read(fd, &x, sizeof(x)) == sizeof(x) &&
+                x.magic == HISTORY_INDEX_MAGIC && x.version == HISTORY_INDEX_VERSION &&
+                x.count <= h->count && fstat(fd, &st) == 0 &&
+                st.st_size == (off_t)(sizeof(x) + x.count * sizeof(uint32_t));
+        if (valid && x.count > 0) {
+                h->by_score = malloc(x.count * sizeof(uint32_t));
+                size_t size = x.count * sizeof(uint32_t);
+                valid = h->by_score != NULL && read(fd, h->by_score, size) == (ssize_t)size;
+                for (uint32_t i=0; valid && i<x.count; i++)
+                        valid = h->by_score[i] < x.count;
+        }
+        close(fd);
+        if (valid)
+                h->header = x;
+}
 
-        case KEY_LEFT:
-                return INPUT_LEFT;
+// Map the history and read its index, which is left as it was found. Only
+// whole records count, one that was cut short by a crash is left out.
+static bool history_open(struct history *h) {
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        memset(h, 0, sizeof(*h));
+        history_index_reset(&h->header);
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, HISTORY_FILE))
+                return false;
 
-        case KEY_RIGHT:
-                return INPUT_RIGHT;
-                
-        case 'P':
-        case 'p':
-                return INPUT_PAUSE;
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return errno == ENOENT;
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+                close(fd);
+                return false;
+        }
+        h->count = st.st_size / sizeof(struct game_record);
+        h->mapped_size = h->count * sizeof(struct game_record);
+        if (h->count > 0) {
+                h->mapped = mmap(NULL, h->mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (h->mapped == MAP_FAILED) {
+                        h->mapped = NULL;
+                        close(fd);
+                        return false;
+                }
+                h->records = h->mapped;
+        }
+        close(fd);
+        
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, HISTORY_INDEX_FILE))
+                return false;
+        history_index_read(h, filename);
+        return true;
+}
 
-        case 'Q':
-        case 'q':
-                return INPUT_EXIT;
+static void history_close(struct history *h) {
+        if (h->mapped != NULL)
+                munmap(h->mapped, h->mapped_size);
+        free(h->by_score);
+}
 
-        default:
-                return INPUT_NONE;
+// Only while holding the lock
+static bool history_index_write(struct history *h) {
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        struct iovec iov[2] = {
+                {&h->header, sizeof(h->header)},
+                {h->by_score, h->count * sizeof(uint32_t)}
+        };
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, HISTORY_INDEX_FILE) ||
+            !replace_file(filename, iov, 2)) {
+                perror("History index was not saved");
+                return false;
         }
+        return true;
 }
 
+// Only while holding the lock. A record that was cut short is written over.
+// Nothing but the record is written, save for every HISTORY_INDEX_INTERVAL
+// games when the index is caught up.
+static bool history_add(const struct game_record *e) {
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, HISTORY_FILE)) {
+                fprintf(stderr, "Game was not saved: Could not determine path.\n");
+                return false;
+        }
+        
+        int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        struct stat st;
+        bool saved = fd != -1 && fstat(fd, &st) == 0 &&
+                ftruncate(fd, st.st_size - st.st_size % sizeof(*e)) == 0 &&
+                write(fd, e, sizeof(*e)) == sizeof(*e) && fsync(fd) == 0 &&
+                (st.st_size > 0 || sync_directory_of(filename));
+        if (fd != -1)
+                close(fd);
+        if (!saved) {
+                perror("Game was not saved");
+                return false;
+        }
+        if ((st.st_size / sizeof(*e) + 1) % HISTORY_INDEX_INTERVAL != 0)
+                return true;
 
+        struct history h;
+        if (!history_open(&h)) {
+                fprintf(stderr, "History index was not saved: Could not read the history.\n");
+                return false;
+        }
+        if (history_index_update(&h))
+                saved = history_index_write(&h);
+        history_close(&h);
+        return saved;
+}
 
-static bool gameover_wait_input(void) {
-        static long us_until_next_read = INPUT_TIME_US;
+static void init_hiscore(void) {
+        hiscore = 0;
         
-        int c = getch();
-        if (us_until_next_read > 0) {
-                us_until_next_read -= DELAY_US;
-                return false;
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        struct leaderboard lb;
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, LEADERBOARD_FILE)) {
+                fprintf(stderr, "Hiscore was not loaded: Could not safely determine path.\n");
+                return;
+        }
+        if (!leaderboard_read(filename, &lb))
+                fprintf(stderr, "Hiscore was not loaded: %s is not a leaderboard.\n", filename);
+        else if (lb.count > 0)
+                hiscore = lb.entries[0].score;
+
+        // From before there was a leaderboard
+        if (get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, HISCORE_FILE)) {
+                FILE *f = fopen(filename, "r");
+                long old_hiscore;
+                if (f != NULL) {
+                        if (fscanf(f, "%ld", &old_hiscore) == 1 && old_hiscore > hiscore)
+                                hiscore = old_hiscore;
+                        fclose(f);
+                }
         }
-        return c != ERR;
 }
 
+// FNV-1a
+static uint64_t checksum(const void *data, size_t size) {
+        const unsigned char *bytes = data;
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i=0; i<size; i++) {
+                hash ^= bytes[i];
+                hash *= 0x100000001b3ULL;
+        }
+        return hash;
+}
 
+static uint64_t saved_game_checksum(const struct saved_game *s) {
+        const char *start = (const char *)&s->checksum + sizeof(s->checksum);
+        return checksum(start, (const char *)(s + 1) - start);
+}
 
-// Hiscore functions
+static void saved_game_fill(struct saved_game *s, const struct tetris_game *g, long played_us) {
+        memset(s, 0, sizeof(*s));
+        s->magic = SAVE_MAGIC;
+        s->version = SAVE_VERSION;
+        s->game_size = sizeof(s->game);
+        s->played_us = played_us;
+        s->game = *g;
+        s->checksum = saved_game_checksum(s);
+}
 
-static bool get_hiscore_filename(char *result, size_t maxsize) {
-        const char *base = getenv("XDG_DATA_HOME");
-        if (base == NULL) {
-                const char *home = getenv("HOME");
-                if (home == NULL) {
-                        return false;
-                }
+static bool saved_game_is_valid(const struct saved_game *s) {
+        return s->magic == SAVE_MAGIC && s->version == SAVE_VERSION && s->game_size == sizeof(s->game) &&
+                s->checksum == saved_game_checksum(s) && tetris_game_is_valid(&s->game);
+}
 
-                if (!mystrncpy(&result, home, &maxsize)) {
-                        return false;
-                }
-                if (!mystrncpy(&result, "/.local/share", &maxsize)) {
-                        return false;
-                }
-        } else {
-                if (!mystrncpy(&result, base, &maxsize)) {
-                        return false;
-                }
+// Only while holding the lock
+static bool save_game(const struct tetris_game *g, long played_us) {
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, SAVE_FILE)) {
+                fprintf(stderr, "Game was not saved: Could not determine path.\n");
+                return false;
         }
-
-        if (!mystrncpy(&result, "/" HISCORE_FILE, &maxsize)) {
+        
+        struct saved_game s;
+        saved_game_fill(&s, g, played_us);
+        struct iovec iov = {&s, sizeof(s)};
+        if (!replace_file(filename, &iov, 1)) {
+                perror("Game was not saved");
                 return false;
         }
         return true;
 }
 
-static void init_hiscore(void) {
-        hiscore = 0;
+// Picks up the saved game, if there's one, and removes it so that it's only
+// ever resumed once. It comes back paused. Returns how long it had been
+// played, or -1 if there was nothing to resume.
+static long resume_game(struct tetris_game *g) {
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, SAVE_FILE))
+                return -1;
+        int lock = lock_data(LOCK_EX);
+        if (lock == -1)
+                return -1;
         
-        static char hiscore_filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
-        if (get_hiscore_filename(hiscore_filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH)) {
-                FILE *f = fopen(hiscore_filename, "r");
-                if (f != NULL) {
-                        fscanf(f, "%ld", &hiscore);
-                        fclose(f);
-                } else {
-                        perror("Hiscore was not loaded");
+        long played_us = -1;
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0 && st.st_size == sizeof(struct saved_game)) {
+                struct saved_game *s = mmap(NULL, sizeof(*s), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (s != MAP_FAILED) {
+                        if (saved_game_is_valid(s)) {
+                                *g = s->game;
+                                g->paused = true;
+                                played_us = s->played_us;
+                        }
+                        munmap(s, sizeof(*s));
                 }
-        } else {
-                fprintf(stderr, "Hiscore was not loaded: Could not safely determine path.\n");
         }
+        if (fd != -1) {
+                close(fd);
+                if (played_us == -1)
+                        fprintf(stderr, "Saved game was not resumed: %s is stale or corrupt.\n", filename);
+                unlink(filename);
+        }
+        
+        unlock_data(lock);
+        return played_us;
 }
 
+// A game that isn't over is saved to be resumed, a finished one is
+// recorded. If it can't be saved, or was being recorded to a replay, it's
+// recorded as it is.
 static void save_hiscore(void) {
-        static char hiscore_filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
-        if (get_hiscore_filename(hiscore_filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH)) {
-                if (make_directory_exist(hiscore_filename)) {
-                        FILE *f = fopen(hiscore_filename, "w");
-                        if (f != NULL) {
-                                fprintf(f, "%ld", hiscore);
-                                fclose(f);
-                        } else {
-                                perror("Hiscore was not saved");
-                        }
-                } else {
-                        fprintf(stderr, "Hiscore was not saved: Could not create parent directory.\n");
+        const struct tetris_game *g = played.game;
+        if (g == NULL)
+                return;
+
+        TRACE_BEGIN(TRACE_HISCORE_SAVE);
+        struct game_record e = {
+                .score = g->score,
+                .date = time(NULL),
+                .lines = g->lines,
+                .level = g->level,
+                .duration_s = (now_us() - played.start_us) / 1000000
+        };
+        int lock = lock_data(LOCK_EX);
+        if (lock != -1) {
+                if (tetris_game_is_over(g) || played.recording || !save_game(g, now_us() - played.start_us)) {
+                        if (e.score > 0)
+                                leaderboard_add(&e);
+                        history_add(&e);
                 }
-        } else {
-                fprintf(stderr, "Hiscore was not saved: Could not safely determine path.\n");
+                unlock_data(lock);
         }
+        TRACE_END(TRACE_HISCORE_SAVE);
 }
 
-static void update_score(long value) {
-        if (value == SOFT_DROP_SCORE || value == HARD_DROP_SCORE) {
-                score += value;
-        } else {
-                score += value * level;
+static void print_leaderboard(void) {
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        struct leaderboard lb;
+        if (!get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, LEADERBOARD_FILE) ||
+            !leaderboard_read(filename, &lb)) {
+                fprintf(stderr, "Could not read the leaderboard.\n");
+                return;
         }
-        
-        if (score > hiscore) {
-                hiscore = score;
+
+        printf("%4s %10s %6s %5s %8s  %s\n", "", "score", "lines", "level", "time", "date");
+        for (uint32_t i=0; i<lb.count; i++) {
+                const struct game_record *e = &lb.entries[i];
+                time_t date = e->date;
+                char date_text[32];
+                strftime(date_text, sizeof(date_text), "%Y-%m-%d %H:%M", localtime(&date));
+                printf("%3u. %10lld %6u %5u %5u:%02u  %s\n", i+1, (long long)e->score, e->lines, e->level,
+                       e->duration_s / 60, e->duration_s % 60, date_text);
         }
 }
 
+// Score of the game at the given percentile, nearest rank
+static int64_t history_percentile(const struct history *h, int percent) {
+        uint32_t rank = ((uint64_t)h->count * percent + 99) / 100;
+        return h->records[h->by_score[rank > 0 ? rank - 1 : 0]].score;
+}
+
+// Where the games played since date start in the records
+static uint32_t history_since(const struct history *h, int64_t date) {
+        uint32_t lo = 0, hi = h->count;
+        while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (h->records[mid].date < date)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
 
+static void print_duration(const char *format, uint64_t s) {
+        char text[32];
+        snprintf(text, sizeof(text), "%lu:%02lu", (unsigned long)(s / 60), (unsigned long)(s % 60));
+        printf(format, text);
+}
 
-// Piece generation functions
+// Everything comes from the index, save for the games since it was last
+// brought up to date and those of the last month, which are few enough to
+// go through
+static int print_stats(void) {
+        // Only read, any games the saved index doesn't cover yet are added
+        // to it here, in memory
+        struct history h;
+        int lock = lock_data(LOCK_SH);
+        if (lock == -1)
+                return EXIT_FAILURE;
+        bool opened = history_open(&h);
+        unlock_data(lock);
+        if (!opened) {
+                fprintf(stderr, "Could not read the history.\n");
+                return EXIT_FAILURE;
+        }
+        history_index_update(&h);
+        if (h.count == 0) {
+                printf("No games played yet.\n");
+                history_close(&h);
+                return EXIT_SUCCESS;
+        }
+        
+        const struct history_index_header *x = &h.header;
+        const struct game_record *best = &h.records[h.by_score[h.count - 1]];
+        printf("%u games", h.count);
+        print_duration(", %s played\n\n", x->total_duration_s);
+        printf("%-10s %10s %6s %5s %8s\n", "", "score", "lines", "level", "time");
+        printf("%-10s %10.0f %6.1f %5.1f ", "average", (double)x->total_score / h.count,
+               (double)x->total_lines / h.count, (double)x->total_levels / h.count);
+        print_duration("%8s\n", x->total_duration_s / h.count);
+        printf("%-10s %10lld %6u %5u ", "best", (long long)best->score, x->best_lines, x->best_level);
+        print_duration("%8s\n\n", x->longest_s);
+
+        static const int percentiles[] = {10, 25, 50, 75, 90, 99};
+        printf("%-10s", "score");
+        for (size_t i=0; i<sizeof(percentiles)/sizeof(*percentiles); i++)
+                printf(" %9d%%", percentiles[i]);
+        printf("\n%-10s", "");
+        for (size_t i=0; i<sizeof(percentiles)/sizeof(*percentiles); i++)
+                printf(" %10lld", (long long)history_percentile(&h, percentiles[i]));
+        printf("\n\n");
+
+        static const struct {
+                const char *name;
+                long seconds;
+        } periods[] = {{"last day", 24 * 3600L}, {"last week", 7 * 24 * 3600L}, {"last month", 30 * 24 * 3600L}};
+        int64_t now = time(NULL);
+        printf("%-10s %6s %10s %10s\n", "", "games", "average", "best");
+        for (size_t i=0; i<sizeof(periods)/sizeof(*periods); i++) {
+                uint32_t first = history_since(&h, now - periods[i].seconds);
+                int64_t total = 0, best_score = 0;
+                for (uint32_t j=first; j<h.count; j++) {
+                        int64_t score = h.records[j].score;
+                        total += score;
+                        if (score > best_score)
+                                best_score = score;
+                }
+                uint32_t games = h.count - first;
+                printf("%-10s %6u %10.0f %10lld\n", periods[i].name, games,
+                       games > 0 ? (double)total / games : 0.0, (long long)best_score);
+        }
 
-static void init_shuffle_pieces(void) {
-        shuffle(spawn_order, 7);
+        history_close(&h);
+        return EXIT_SUCCESS;
 }
 
-static enum tetrimino next_random_piece(void) {
-        if (spawn_next_i == 7) {
-                spawn_next_i = 0;
-                memcpy(spawn_order, spawn_order+7, 7*sizeof(enum tetrimino));
+// The whole histogram of every phase, next to the hiscore
+static void save_phase_histograms(void) {
+        if (phase_histograms[PHASE_WAIT].count == 0)
+                return;
+        
+        static char phases_filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        if (!get_data_filename(phases_filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, PHASES_FILE) ||
+            !make_directory_exist(phases_filename)) {
+                fprintf(stderr, "Phase timings were not saved: Could not determine path.\n");
+                return;
         }
-                
-        if (spawn_next_i == 0)
-                shuffle(spawn_order+7, 7);
-                
-        return spawn_order[spawn_next_i++];
+        
+        FILE *f = fopen(phases_filename, "w");
+        if (f == NULL) {
+                perror("Phase timings were not saved");
+                return;
+        }
+        for (int p=0; p<PHASE_COUNT; p++) {
+                const struct phase_histogram *h = &phase_histograms[p];
+                fprintf(f, "%s: count %ld, max %ld ns\n", phase_names[p], h->count, h->max_ns);
+                for (int i=0; i<PHASE_BUCKETS; i++)
+                        if (h->buckets[i] > 0)
+                                fprintf(f, "  < %10ld ns: %ld\n", 1L << i, h->buckets[i]);
+        }
+        fclose(f);
 }
 
 
 
-// Gameplay functions
+// Game loop functions
 
-static long get_step_time(void) {
-        double time = pow(0.8 - ((double)level - 1) * 0.007, (double)level - 1) * 1e6;
-        return (long)time;
+static void scheduler_arm(struct tick_scheduler *sc) {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        if (sc->running) {
+                its.it_value.tv_sec = sc->next_tick_us / 1000000L;
+                its.it_value.tv_nsec = sc->next_tick_us % 1000000L * 1000L;
+        }
+        timerfd_settime(sc->timer, TFD_TIMER_ABSTIME, &its, NULL);
 }
 
-static void update_level(int lines_score) {
-        goal -= lines_score;
-        while (goal <= 0) {
-                goal += level * 5;
-                level++;
-        }
+// Ticks start again one whole tick from now
+static void scheduler_set_running(struct tick_scheduler *sc, bool running) {
+        sc->running = running;
+        sc->next_tick_us = now_us() + TETRIS_TICK_US;
+        scheduler_arm(sc);
 }
 
-static bool collision(enum tetrimino piece, enum tetrimino_rotation rotation, struct point location) {
-        for (int j=0; j<4; j++) {
-                for (int i=0; i<4; i++) {
-                        struct point c;
-                        c.x = location.x + i;
-                        c.y = location.y + j;
-                        
-                        if (piece_shapes[piece][rotation][j][i]) {
-                                if (c.x < 0 || c.x >= TETRIS_PLAYFIELD_X)
-                                        return true;
-                                if (c.y < 0 || c.y >= TETRIS_PLAYFIELD_Y)
-                                        return true;
-                                
-                                enum tetris_color color = playfield[c.y][c.x];
-                        
-                                if (color != TETRIS_COLOR_BLACK)
-                                        return true;
-                        }
+static void scheduler_record(struct tick_scheduler *sc, long late_us) {
+        int bucket = 0;
+        while (bucket < TICK_LATE_BUCKETS-1 && late_us >= (1L << bucket))
+                bucket++;
+
+        sc->ticks++;
+        sc->late_histogram[bucket]++;
+        sc->total_late_us += late_us;
+        if (late_us > sc->max_late_us)
+                sc->max_late_us = late_us;
+}
+
+// Run every tick that's due by now, catching up after slow frames
+static void scheduler_run(struct tick_scheduler *sc, struct tetris_game *g) {
+        uint64_t expirations;
+        if (read(sc->timer, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+                return;
+        if (!sc->running)
+                return;
+
+        long now = now_us();
+        int ticks = 0;
+        while (now >= sc->next_tick_us) {
+                if (ticks == TICK_MAX_CATCH_UP) {
+                        // Most likely we were stopped or suspended, there's
+                        // no point in playing all of that back at once
+                        long missed = (now - sc->next_tick_us) / TETRIS_TICK_US + 1;
+                        sc->dropped += missed;
+                        sc->next_tick_us += missed * TETRIS_TICK_US;
+                        break;
                 }
+                
+                scheduler_record(sc, now - sc->next_tick_us);
+                if (ticks > 0)
+                        sc->caught_up++;
+                replay_tick(&recorder, g);
+                tetris_game_tick(g);
+                sc->next_tick_us += TETRIS_TICK_US;
+                ticks++;
+        }
+
+        scheduler_arm(sc);
+}
+
+static void print_tick_stats(void) {
+        const struct tick_scheduler *sc = &scheduler;
+        if (!print_tick_stats_at_exit || sc->ticks == 0)
+                return;
+        
+        fprintf(stderr, "ticks: %ld, caught up: %ld, dropped: %ld\n", sc->ticks, sc->caught_up, sc->dropped);
+        fprintf(stderr, "late: mean %.1f us, max %ld us\n", (double)sc->total_late_us / sc->ticks, sc->max_late_us);
+        for (int i=0; i<TICK_LATE_BUCKETS; i++) {
+                if (sc->late_histogram[i] > 0)
+                        fprintf(stderr, "  < %7ld us: %ld\n", 1L << i, sc->late_histogram[i]);
         }
+}
 
-        return false;
+static void wake_render_thread(void) {
+        uint64_t one = 1;
+        if (write(snapshots.wakeup, &one, sizeof(one)) == -1)
+                perror("write");
 }
 
-static void update_shadow_location(void) {
-        current_shadow_location = current_piece_location;
-        while (!collision(current_piece, current_piece_rotation, current_shadow_location)) {
-                current_shadow_location.y++;
-        }
-        current_shadow_location.y--;
+// Hand the game as it is now over to the render thread
+static void publish_game(const struct tetris_game *g) {
+        struct snapshot *s = snapshot_back(&snapshots);
+        s->game = *g;
+        s->hiscore = hiscore;
+        s->phase_overlay = show_phase_overlay;
+        snapshot_publish(&snapshots);
+        wake_render_thread();
 }
 
-static bool has_full_lines(int *line) {
-        bool has_full_lines;
-        for (int y=0; y<TETRIS_PLAYFIELD_Y; y++) {
-                has_full_lines = true;
-                for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        if (playfield[y][x] == TETRIS_COLOR_BLACK) {
-                                has_full_lines = false;
-                                break;
-                        }
+// Draws the latest snapshot whenever there's a new one, so a slow terminal
+// only makes it skip snapshots, and never holds up the game. It's the only
+// thread that touches the screen, so it's also the one that takes resizes.
+static void *render_loop(void *arg) {
+        (void)arg;
+        
+        sigset_t wait_mask;
+        pthread_sigmask(SIG_SETMASK, NULL, &wait_mask);
+        sigdelset(&wait_mask, SIGWINCH);
+        
+        struct pollfd fd = {snapshots.wakeup, POLLIN, 0};
+        for (;;) {
+                if (ppoll(&fd, 1, NULL, &wait_mask) == -1 && errno != EINTR) {
+                        perror("ppoll");
+                        return NULL;
                 }
-                if (has_full_lines) {
-                        *line = y;
-                        return true;
+                
+                uint64_t count;
+                if (read(snapshots.wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                        perror("read");
+                        return NULL;
                 }
+                if (__atomic_load_n(&render_thread_quit, __ATOMIC_ACQUIRE))
+                        return NULL;
+                
+                if (terminal_resized)
+                        handle_resize();
+                
+                long start = now_ns();
+                const struct snapshot *s = snapshot_latest(&snapshots);
+                if (tetris_game_is_over(&s->game))
+                        draw_gameover(&s->game, s->hiscore);
+                else
+                        draw_screen(&s->game, s->hiscore);
+                if (s->phase_overlay)
+                        draw_phase_overlay(layout.ov_st);
+                phase_end(PHASE_DRAW, &start);
+                
+                frame_present(&frame, &shown_frame);
+                phase_end(PHASE_PRESENT, &start);
         }
-        return false;
 }
 
-static int clear_full_lines(void) {
-        int full_lines_count = 0;
-
-        int y;
-        while (has_full_lines(&y)) {
-                full_lines_count++;
-                memmove(playfield[1], playfield[0], sizeof(enum tetris_color)*TETRIS_PLAYFIELD_X*y);
+static void start_render_thread(void) {
+        snapshots.wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (snapshots.wakeup == -1) {
+                endwin();
+                perror("eventfd");
+                exit(EXIT_FAILURE);
         }
+
+        // Only the render thread takes SIGWINCH, and only while it waits.
+        // Signals to quit go to the game thread, likewise only while it
+        // waits, since it's the one to exit.
+        sigset_t winch, quit;
+        sigemptyset(&winch);
+        sigaddset(&winch, SIGWINCH);
+        sigemptyset(&quit);
+        sigaddset(&quit, SIGHUP);
+        sigaddset(&quit, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &winch, NULL);
+        pthread_sigmask(SIG_BLOCK, &quit, NULL);
         
-        return full_lines_count;
+        int err = pthread_create(&render_thread, NULL, render_loop, NULL);
+        pthread_sigmask(SIG_SETMASK, NULL, &game_wait_mask);
+        sigdelset(&game_wait_mask, SIGHUP);
+        sigdelset(&game_wait_mask, SIGTERM);
+        if (err != 0) {
+                endwin();
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                exit(EXIT_FAILURE);
+        }
+        render_thread_running = true;
+}
+
+// Done at exit, before the screen is put back
+static void stop_render_thread(void) {
+        if (!render_thread_running || pthread_equal(pthread_self(), render_thread))
+                return;
+
+        __atomic_store_n(&render_thread_quit, true, __ATOMIC_RELEASE);
+        wake_render_thread();
+        pthread_join(render_thread, NULL);
+        render_thread_running = false;
 }
 
 __attribute__((noreturn))
-static void gameover_loop(void) {
+static void gameover_loop(const struct tetris_game *g) {
+        publish_game(g);
+
+        // Keys that were still coming in when the game ended shouldn't skip this screen
+        usleep(INPUT_TIME_US);
+        terminal_input_read(&terminal);
+        terminal.len = 0;
+
+        struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+        struct key_event ev;
         for (;;) {
-                draw_gameover();
-                if (gameover_wait_input()) {
+                if (quit_requested)
                         exit(EXIT_SUCCESS);
-                }
-                usleep(DELAY_US);
+                ppoll(&fd, 1, NULL, &game_wait_mask);
+                terminal_input_read(&terminal);
+                while (terminal_input_next(&terminal, &ev))
+                        if (ev.type == KEY_EVENT_PRESS)
+                                exit(EXIT_SUCCESS);
         }
 }
 
-static void step(void) {
-        if (paused)
-                return;
-        
-        if (us_until_next_step <= 0) {
-                us_until_next_step = get_step_time();
-                current_piece_location.y += 1;
-                if (collision(current_piece, current_piece_rotation, current_piece_location)) {
-                        hard_dropped = false;
-                        
-                        // Detect T-spin
-                        if (current_piece == TETRIMINO_T && last_movement_was_spin) {
-                                int x = current_piece_location.x;
-                                int y = current_piece_location.y;
-
-                                int count = 0;
-                                if (playfield[y][x] != TETRIS_COLOR_BLACK)
-                                        count++;
-                                if (playfield[y][x+2] != TETRIS_COLOR_BLACK)
-                                        count++;
-                                if (playfield[y+2][x+2] != TETRIS_COLOR_BLACK)
-                                        count++;
-                                if (playfield[y+2][x] != TETRIS_COLOR_BLACK)
-                                        count++;
-
-                                if (count >= 3)
-                                        update_score(T_SPIN_SCORE);
-                        }
-                        last_movement_was_spin = false;
-
-                        // Add piece to playfield
-                        for (int j=0; j<4; j++) {
-                                for (int i=0; i<4; i++) {
-                                        if (piece_shapes[current_piece][current_piece_rotation][j][i]) {
-                                                int x = current_piece_location.x + i;
-                                                int y = current_piece_location.y + j - 1;
-                                                playfield[y][x] = piece_color(current_piece);
-                                        }
-                                }
-                        }
 
-                        int full_lines_count = clear_full_lines();
-                        switch (full_lines_count) {
-                        case 1:
-                                update_score(SINGLE_SCORE);
-                                update_level(SINGLE_LEVEL_SCORE);
-                                break;
-                        case 2:
-                                update_score(DOUBLE_SCORE);
-                                update_level(DOUBLE_LEVEL_SCORE);
-                                break;
-                        case 3:
-                                update_score(TRIPLE_SCORE);
-                                update_level(TRIPLE_LEVEL_SCORE);
-                                break;
-                        case 4:
-                                update_score(TETRIS_SCORE);
-                                update_level(TETRIS_LEVEL_SCORE);
-                                break;
-                        }
-                        
-                        current_piece = next_random_piece();
-                        current_piece_rotation = SPAWN_ROTATED;
-                        current_piece_location.x = 5;
-                        current_piece_location.y = 20;
-                        can_hold = true;
-                        update_shadow_location();
 
-                        if (collision(current_piece, current_piece_rotation, current_piece_location))
-                                gameover_loop();
-                }
-        } else {
-                us_until_next_step -= DELAY_US;
-        }
-}
+#ifdef RENDER_BENCH
 
-static bool rotate(enum tetrimino_rotation next) {
-        enum tetrimino_rotation curr = current_piece_rotation;
+// Render benchmark
+//
+// For comparing rendering changes by frames per second and by how much
+// they send to the terminal. Plays a scripted game and draws every tick of
+// it at a few fixed sizes and with each backend, on a terminal that ncurses
+// opens with newterm() on a temporary file. What's sent is how much that
+// file grew.
 
-        int i;
-        switch(current_piece) {
-        case TETRIMINO_TEST:
-        case TETRIMINO_O:
-                current_piece_rotation = next;
-                if (collision(current_piece, current_piece_rotation, current_piece_location)) {
-                        current_piece_rotation = curr;
-                        return false;
-                } else {
-                        return true;
-                }
-        case TETRIMINO_I:
-                i = 1;
-                break;
-                
-        case TETRIMINO_T:
-        case TETRIMINO_S:
-        case TETRIMINO_Z:
-        case TETRIMINO_J:
-        case TETRIMINO_L:
-                i = 0;
-                break;
+#define RENDER_BENCH_FRAMES 5000
+#define RENDER_BENCH_TERM "xterm-256color"
 
-        default:
-                return false;
-        }
+struct render_bench_config {
+        int columns, rows;
+        enum render_backend backend;
+        bool half_blocks;
+};
 
-        int j;
-        if (curr == SPAWN_ROTATED && next == CLOCKWISE_ROTATED)
-                j = 0;
-        else if (curr == CLOCKWISE_ROTATED && next == SPAWN_ROTATED)
-                j = 1;
-        else if (curr == CLOCKWISE_ROTATED && next == TWICE_ROTATED)
-                j = 2;
-        else if (curr == TWICE_ROTATED && next == CLOCKWISE_ROTATED)
-                j = 3;
-        else if (curr == TWICE_ROTATED && next == COUNTER_ROTATED)
-                j = 4;
-        else if (curr == COUNTER_ROTATED && next == TWICE_ROTATED)
-                j = 5;
-        else if (curr == COUNTER_ROTATED && next == SPAWN_ROTATED)
-                j = 6;
-        else if (curr == SPAWN_ROTATED && next == COUNTER_ROTATED)
-                j = 7;
-        else
-                return false;
+static const struct render_bench_config render_bench_configs[] = {
+        {80, 30, RENDER_CURSES, false},
+        {120, 40, RENDER_CURSES, false},
+        {200, 60, RENDER_CURSES, false},
+        {80, 30, RENDER_CURSES, true},
+        {80, 30, RENDER_ANSI, false},
+        {120, 40, RENDER_ANSI, false},
+        {200, 60, RENDER_ANSI, false},
+        {80, 30, RENDER_ANSI, true},
+};
 
-        struct point curr_coords = current_piece_location;
-        for (int k=0; k<5; k++) {
-                struct point c = wall_kicks[i][j][k];
+// An input every other tick, one round of these drops two pieces
+static const enum input_type render_bench_script[] = {
+        INPUT_LEFT, INPUT_LEFT, INPUT_CLOCKWISE_ROTATION, INPUT_SOFT_DROP, INPUT_SOFT_DROP,
+        INPUT_HARD_DROP, INPUT_NONE, INPUT_NONE, INPUT_HOLD, INPUT_RIGHT, INPUT_RIGHT,
+        INPUT_RIGHT, INPUT_COUNTERCLOCKWISE_ROTATION, INPUT_HARD_DROP, INPUT_NONE, INPUT_NONE
+};
 
-                current_piece_rotation = next;
-                current_piece_location.x += c.x;
-                current_piece_location.y -= c.y; // in the copy pasted data, up is positive but here down is positive
+struct render_bench_result {
+        double frames_per_second;
+        double draw_us, present_us; // per frame
+        double bytes, calls; // per frame
+};
 
-                if (collision(current_piece, current_piece_rotation, current_piece_location)) {
-                        current_piece_rotation = curr;
-                        current_piece_location = curr_coords;
-                } else {
-                        return true;
-                }
+static void render_bench_run(const struct render_bench_config *c, struct render_bench_result *r) {
+        render_backend = c->backend;
+        half_blocks = c->half_blocks;
+        resizeterm(c->rows, c->columns);
+        clearok(curscr, TRUE);
+        setup_screen();
+
+        struct tetris_game g;
+        uint64_t seed = 1;
+        tetris_game_init(&g, seed);
+        
+        int script_length = sizeof(render_bench_script) / sizeof(render_bench_script[0]);
+        long bytes = lseek(ansi.fd, 0, SEEK_END);
+        long calls = output_calls;
+        long draw_ns = 0, present_ns = 0;
+        for (int i=0; i<RENDER_BENCH_FRAMES; i++) {
+                if (tetris_game_is_over(&g))
+                        tetris_game_init(&g, ++seed);
+                if (i % 2 == 0)
+                        tetris_game_input(&g, render_bench_script[i/2 % script_length]);
+                tetris_game_tick(&g);
+
+                long start = now_ns();
+                draw_screen(&g, 0);
+                long drawn = now_ns();
+                frame_present(&frame, &shown_frame);
+                long presented = now_ns();
+                
+                draw_ns += drawn - start;
+                present_ns += presented - drawn;
         }
 
-        return false;
+        r->frames_per_second = RENDER_BENCH_FRAMES / ((draw_ns + present_ns) / 1e9);
+        r->draw_us = draw_ns / 1e3 / RENDER_BENCH_FRAMES;
+        r->present_us = present_ns / 1e3 / RENDER_BENCH_FRAMES;
+        r->bytes = (double)(lseek(ansi.fd, 0, SEEK_END) - bytes) / RENDER_BENCH_FRAMES;
+        r->calls = (double)(output_calls - calls) / RENDER_BENCH_FRAMES;
 }
 
-static void process_input(void) {
-        static long us_until_next_read = INPUT_TIME_US;
+static int render_bench(void) {
+        FILE *out = tmpfile();
+        FILE *in = fopen("/dev/null", "r");
+        if (out == NULL || in == NULL) {
+                perror("render bench");
+                return EXIT_FAILURE;
+        }
+        ansi.fd = fileno(out);
+        setlocale(LC_ALL, "C.UTF-8"); // for the half blocks, whatever the environment says
         
-        if (us_until_next_read > 0)
-                us_until_next_read -= DELAY_US;
-
-        int c = getch();
-        if (us_until_next_read > 0) {
-                return;
+        SCREEN *screen = newterm(RENDER_BENCH_TERM, out, in);
+        if (screen == NULL) {
+                fprintf(stderr, "newterm: no terminfo for %s\n", RENDER_BENCH_TERM);
+                return EXIT_FAILURE;
         }
+        setup_colors();
 
-        enum input_type t = get_player_input(c);
-
-        if (t == INPUT_EXIT)
-                exit(EXIT_SUCCESS);
-
-        if (t == INPUT_PAUSE)
-                paused = !paused;
-
-        if (paused)
-                return;
-
-        if (!hard_dropped) {
-                switch(t) {
-                case INPUT_CLOCKWISE_ROTATION:
-                        if (rotate((current_piece_rotation + 1) % 4)) {
-                                last_movement_was_spin = true;
-                                //us_until_next_step = STEP_TIME_US;
-                                update_shadow_location();
-                        }
-                        break;
-                
-                case INPUT_HARD_DROP:
-                        while (!collision(current_piece, current_piece_rotation, current_piece_location)) {
-                                current_piece_location.y++;
-                                update_score(HARD_DROP_SCORE);
-                        }
-                        current_piece_location.y--;
-                        us_until_next_step = get_step_time();
-                        hard_dropped = true;
-                        break;
-                
-                case INPUT_HOLD:
-                        if (can_hold) {
-                                enum tetrimino held = current_held_piece;
-                                current_held_piece = current_piece;
-                                if (held == TETRIMINO_TEST)
-                                        current_piece = next_random_piece();
-                                else
-                                        current_piece = held;
-                                current_piece_rotation = SPAWN_ROTATED;
-                                current_piece_location.x = 5;
-                                current_piece_location.y = 20;
-                                us_until_next_step = get_step_time();
-                                can_hold = false;
-                                last_movement_was_spin = false;
-                                update_shadow_location();
-                        }
-                        break;
-                
-                case INPUT_COUNTERCLOCKWISE_ROTATION:
-                        if (rotate((current_piece_rotation - 1) % 4)) {
-                                last_movement_was_spin = true;
-                                //us_until_next_step = get_step_time();
-                                update_shadow_location();
-                        }
-                        break;
-                
-                case INPUT_SOFT_DROP:
-                        current_piece_location.y += 1;
-                        update_score(SOFT_DROP_SCORE);
-                        if (collision(current_piece, current_piece_rotation, current_piece_location))
-                                current_piece_location.y -= 1;
-                        else
-                                us_until_next_step = get_step_time();
-                        break;
-                
-                case INPUT_LEFT:
-                        current_piece_location.x -= 1;
-                        if (collision(current_piece, current_piece_rotation, current_piece_location)) {
-                                current_piece_location.x += 1;
-                        } else {
-                                //us_until_next_step = get_step_time();
-                                update_shadow_location();
-                        }
-                        break;
-                
-                case INPUT_RIGHT:
-                        current_piece_location.x += 1;
-                        if (collision(current_piece, current_piece_rotation, current_piece_location)) {
-                                current_piece_location.x -= 1;
-                        } else {
-                                //us_until_next_step = get_step_time();
-                                update_shadow_location();
-                        }
-                        break;
+        int count = sizeof(render_bench_configs) / sizeof(render_bench_configs[0]);
+        struct render_bench_result results[sizeof(render_bench_configs) / sizeof(render_bench_configs[0])];
+        for (int i=0; i<count; i++)
+                render_bench_run(&render_bench_configs[i], &results[i]);
+        endwin();
+        delscreen(screen);
+        
+        fprintf(stderr, "%-8s %-7s %-5s %10s %10s %10s %12s %12s\n", "size", "backend", "half",
+                "frames/s", "draw us", "present us", "bytes/frame", "calls/frame");
+        printf("{\n");
+        printf("  \"frames\": %d,\n", RENDER_BENCH_FRAMES);
+        printf("  \"term\": \"%s\",\n", RENDER_BENCH_TERM);
+        printf("  \"configs\": [\n");
+        for (int i=0; i<count; i++) {
+                const struct render_bench_config *c = &render_bench_configs[i];
+                const struct render_bench_result *r = &results[i];
+                const char *backend = c->backend == RENDER_ANSI ? "ansi" : "curses";
+                char size[16];
+                snprintf(size, sizeof(size), "%dx%d", c->columns, c->rows);
                 
-                default:
-                        return;
-                }
+                fprintf(stderr, "%-8s %-7s %-5s %10.0f %10.2f %10.2f %12.1f %12.1f\n", size, backend,
+                        c->half_blocks ? "yes" : "no", r->frames_per_second, r->draw_us, r->present_us,
+                        r->bytes, r->calls);
+                printf("    {\"size\": \"%s\", \"backend\": \"%s\", \"half_blocks\": %s, \"frames_per_sec\": %.0f, "
+                       "\"draw_us\": %.3f, \"present_us\": %.3f, \"bytes_per_frame\": %.1f, \"calls_per_frame\": %.1f}%s\n",
+                       size, backend, c->half_blocks ? "true" : "false", r->frames_per_second, r->draw_us,
+                       r->present_us, r->bytes, r->calls, i < count-1 ? "," : "");
         }
-
-        us_until_next_read = INPUT_TIME_US;
+        printf("  ]\n");
+        printf("}\n");
+        
+        return EXIT_SUCCESS;
 }
+#endif /* RENDER_BENCH */
 
 
 
@@ -1707,13 +4678,13 @@ static void test_assert_diff(int expected, int got, char *msg) {
         }
 }
 
-static void test_rng(void) {
+static void test_rng(struct tetris_game *g) {
         int tetriminos[8];
         memset(tetriminos, 0, sizeof(tetriminos));
 
         for (int i=0; i<7000; i++) {
-                tetriminos[current_piece]++;
-                current_piece = next_random_piece();
+                tetriminos[g->current_piece]++;
+                g->current_piece = next_random_piece(g);
         }
 
         test_assert_eq(0, tetriminos[0], "Test tetrimino");
@@ -1727,93 +4698,135 @@ static void test_rng(void) {
         fprintf(stderr, "RNG is correct.\n");
 }
 
-static void reset_playfield(void) {
-        memset(playfield, 0, TETRIS_PLAYFIELD_Y*TETRIS_PLAYFIELD_X*sizeof(enum tetris_color));
+// A fixed seed makes this deterministic, the tolerance is about 5 standard
+// deviations so that any seed should pass unless the shuffle is biased
+static void test_bag_positions(void) {
+        struct tetris_game g;
+        tetris_game_init(&g, 1234);
+
+        int positions[7][8];
+        memset(positions, 0, sizeof(positions));
+
+        enum tetrimino bag[7];
+        memcpy(bag, g.spawn_order, sizeof(bag));
+        for (int n=0; n<70000; n++) {
+                shuffle(&g, bag, 7);
+                for (int i=0; i<7; i++)
+                        positions[i][bag[i]]++;
+        }
+
+        for (int i=0; i<7; i++) {
+                for (int p=TETRIMINO_I; p<=TETRIMINO_L; p++) {
+                        if (positions[i][p] < 9500 || positions[i][p] > 10500) {
+                                fprintf(stderr, "assert failed: piece %d is in bag position %d %d times out of 70000\n", p, i, positions[i][p]);
+                                exit(EXIT_FAILURE);
+                        }
+                }
+        }
+        fprintf(stderr, "Bag positions are uniform\n");
+}
+
+static void set_cell(struct tetris_game *g, int x, int y, enum tetris_color color) {
+        uint32_t bit = 1U << (x + PLAYFIELD_ROW_SHIFT);
+        if (color == TETRIS_COLOR_BLACK)
+                g->playfield[y] &= ~bit;
+        else
+                g->playfield[y] |= bit;
+        g->playfield_colors[y][x] = color;
+        g->column_tops[x] = find_column_top(g, x, 0);
+        update_playfield_top(g);
+}
+
+// Read a cell through the color plane, checking that the bitboard agrees
+static enum tetris_color test_cell(const struct tetris_game *g, int x, int y) {
+        enum tetris_color color = g->playfield_colors[y][x];
+        test_assert_eq(color != TETRIS_COLOR_BLACK, cell_occupied(g, x, y), "Bitboard matches colors");
+        return color;
 }
 
-static void test_single_row() {
-        reset_playfield();
+static void test_single_row(struct tetris_game *g) {
+        reset_playfield(g);
         
         int y = TETRIS_PLAYFIELD_Y-1;
         for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                playfield[y][x] = piece_color(current_piece);
-                current_piece = next_random_piece();
+                set_cell(g, x, y, piece_color(g->current_piece));
+                g->current_piece = next_random_piece(g);
         }
 
-        int nlines = clear_full_lines();
+        int nlines = clear_full_lines(g, TETRIS_PLAYFIELD_Y-4, TETRIS_PLAYFIELD_Y-1);
         test_assert_eq(1, nlines, "Single row, nlines");
 
         for (y = 0; y < TETRIS_PLAYFIELD_Y; y++) {
                 for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y][x], "Single row, playfield");
+                        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x, y), "Single row, playfield");
                 }
         }
 }
 
-static void test_double_row() {
-        reset_playfield();
+static void test_double_row(struct tetris_game *g) {
+        reset_playfield(g);
         
         for (int y = TETRIS_PLAYFIELD_Y-1; y>=TETRIS_PLAYFIELD_Y-2; y--) {
                 for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        playfield[y][x] = piece_color(current_piece);
-                        current_piece = next_random_piece();
+                        set_cell(g, x, y, piece_color(g->current_piece));
+                        g->current_piece = next_random_piece(g);
                 }
         }
 
-        int nlines = clear_full_lines();
+        int nlines = clear_full_lines(g, TETRIS_PLAYFIELD_Y-4, TETRIS_PLAYFIELD_Y-1);
         test_assert_eq(2, nlines, "Double row, nlines");
 
         for (int y = 0; y < TETRIS_PLAYFIELD_Y; y++) {
                 for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y][x], "Double row, playfield");
+                        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x, y), "Double row, playfield");
                 }
         }
 }
 
-static void test_triple_row() {
-        reset_playfield();
+static void test_triple_row(struct tetris_game *g) {
+        reset_playfield(g);
         
         for (int y = TETRIS_PLAYFIELD_Y-1; y>=TETRIS_PLAYFIELD_Y-3; y--) {
                 for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        playfield[y][x] = piece_color(current_piece);
-                        current_piece = next_random_piece();
+                        set_cell(g, x, y, piece_color(g->current_piece));
+                        g->current_piece = next_random_piece(g);
                 }
         }
 
-        int nlines = clear_full_lines();
+        int nlines = clear_full_lines(g, TETRIS_PLAYFIELD_Y-4, TETRIS_PLAYFIELD_Y-1);
         test_assert_eq(3, nlines, "Triple row, nlines");
 
 
         for (int y = 0; y < TETRIS_PLAYFIELD_Y; y++) {
                 for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y][x], "Triple row, playfield");
+                        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x, y), "Triple row, playfield");
                 }
         }
 }
 
-static void test_tetris_row() {
-        reset_playfield();
+static void test_tetris_row(struct tetris_game *g) {
+        reset_playfield(g);
         
         for (int y = TETRIS_PLAYFIELD_Y-1; y>=TETRIS_PLAYFIELD_Y-4; y--) {
                 for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        playfield[y][x] = piece_color(current_piece);
-                        current_piece = next_random_piece();
+                        set_cell(g, x, y, piece_color(g->current_piece));
+                        g->current_piece = next_random_piece(g);
                 }
         }
 
-        int nlines = clear_full_lines();
+        int nlines = clear_full_lines(g, TETRIS_PLAYFIELD_Y-4, TETRIS_PLAYFIELD_Y-1);
         test_assert_eq(4, nlines, "Tetris row, nlines");
 
 
         for (int y = 0; y < TETRIS_PLAYFIELD_Y; y++) {
                 for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y][x], "Tetris row, playfield");
+                        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x, y), "Tetris row, playfield");
                 }
         }
 }
 
-static void test_irregular_rows(void) {
-        reset_playfield();
+static void test_irregular_rows(struct tetris_game *g) {
+        reset_playfield(g);
 
         int x,y;
         //XXXXXXXXXX
@@ -1824,76 +4837,76 @@ static void test_irregular_rows(void) {
         x = 0;
         y = TETRIS_PLAYFIELD_Y-1;
         
-        playfield[y-0][x+0] = piece_color(current_piece);
-        playfield[y-0][x+1] = piece_color(current_piece);
-        playfield[y-0][x+5] = piece_color(current_piece);
-        playfield[y-0][x+6] = piece_color(current_piece);
-        playfield[y-0][x+8] = piece_color(current_piece);
-        
-        playfield[y-1][x+0] = piece_color(current_piece);
-        playfield[y-1][x+1] = piece_color(current_piece);
-        playfield[y-1][x+2] = piece_color(current_piece);
-        playfield[y-1][x+3] = piece_color(current_piece);
-        playfield[y-1][x+4] = piece_color(current_piece);
-        playfield[y-1][x+5] = piece_color(current_piece);
-        playfield[y-1][x+6] = piece_color(current_piece);
-        playfield[y-1][x+7] = piece_color(current_piece);
-        playfield[y-1][x+8] = piece_color(current_piece);
-        playfield[y-1][x+9] = piece_color(current_piece);
-        
-        playfield[y-2][x+3] = piece_color(current_piece);
-        playfield[y-2][x+9] = piece_color(current_piece);
-        
-        playfield[y-3][x+3] = piece_color(current_piece);
-        
-        int nlines = clear_full_lines();
+        set_cell(g, x+0, y-0, piece_color(g->current_piece));
+        set_cell(g, x+1, y-0, piece_color(g->current_piece));
+        set_cell(g, x+5, y-0, piece_color(g->current_piece));
+        set_cell(g, x+6, y-0, piece_color(g->current_piece));
+        set_cell(g, x+8, y-0, piece_color(g->current_piece));
+        
+        set_cell(g, x+0, y-1, piece_color(g->current_piece));
+        set_cell(g, x+1, y-1, piece_color(g->current_piece));
+        set_cell(g, x+2, y-1, piece_color(g->current_piece));
+        set_cell(g, x+3, y-1, piece_color(g->current_piece));
+        set_cell(g, x+4, y-1, piece_color(g->current_piece));
+        set_cell(g, x+5, y-1, piece_color(g->current_piece));
+        set_cell(g, x+6, y-1, piece_color(g->current_piece));
+        set_cell(g, x+7, y-1, piece_color(g->current_piece));
+        set_cell(g, x+8, y-1, piece_color(g->current_piece));
+        set_cell(g, x+9, y-1, piece_color(g->current_piece));
+        
+        set_cell(g, x+3, y-2, piece_color(g->current_piece));
+        set_cell(g, x+9, y-2, piece_color(g->current_piece));
+        
+        set_cell(g, x+3, y-3, piece_color(g->current_piece));
+        
+        int nlines = clear_full_lines(g, TETRIS_PLAYFIELD_Y-4, TETRIS_PLAYFIELD_Y-1);
         test_assert_eq(1, nlines, "Irregular rows, nlines");
 
         for (y=0; y<TETRIS_PLAYFIELD_Y-4; y++) {
                 for (x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y][x], "Irreglar rows, empty");
+                        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x, y), "Irreglar rows, empty");
                 }
         }
         
         x = 0;
         y = TETRIS_PLAYFIELD_Y-1;
 
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+0], "Irregular rows, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+1], "Irregular rows, 1");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-0][x+2], "Irregular rows, 1");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-0][x+3], "Irregular rows, 1");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-0][x+4], "Irregular rows, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+5], "Irregular rows, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+6], "Irregular rows, 1");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-0][x+7], "Irregular rows, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+8], "Irregular rows, 1");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-0][x+9], "Irregular rows, 1");
-        
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+0], "Irregular rows, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+1], "Irregular rows, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+2], "Irregular rows, 2");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-1][x+3], "Irregular rows, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+4], "Irregular rows, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+5], "Irregular rows, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+6], "Irregular rows, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+7], "Irregular rows, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+8], "Irregular rows, 2");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-1][x+9], "Irregular rows, 2");
-        
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+0], "Irregular rows, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+1], "Irregular rows, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+2], "Irregular rows, 3");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-2][x+3], "Irregular rows, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+4], "Irregular rows, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+5], "Irregular rows, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+6], "Irregular rows, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+7], "Irregular rows, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+8], "Irregular rows, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+9], "Irregular rows, 3");
-}
-
-static void test_irregular_rows_2(void) {
-        reset_playfield();
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+0, y-0), "Irregular rows, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+1, y-0), "Irregular rows, 1");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+2, y-0), "Irregular rows, 1");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+3, y-0), "Irregular rows, 1");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+4, y-0), "Irregular rows, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+5, y-0), "Irregular rows, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+6, y-0), "Irregular rows, 1");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+7, y-0), "Irregular rows, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+8, y-0), "Irregular rows, 1");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+9, y-0), "Irregular rows, 1");
+        
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+0, y-1), "Irregular rows, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+1, y-1), "Irregular rows, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+2, y-1), "Irregular rows, 2");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+3, y-1), "Irregular rows, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+4, y-1), "Irregular rows, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+5, y-1), "Irregular rows, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+6, y-1), "Irregular rows, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+7, y-1), "Irregular rows, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+8, y-1), "Irregular rows, 2");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+9, y-1), "Irregular rows, 2");
+        
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+0, y-2), "Irregular rows, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+1, y-2), "Irregular rows, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+2, y-2), "Irregular rows, 3");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+3, y-2), "Irregular rows, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+4, y-2), "Irregular rows, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+5, y-2), "Irregular rows, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+6, y-2), "Irregular rows, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+7, y-2), "Irregular rows, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+8, y-2), "Irregular rows, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+9, y-2), "Irregular rows, 3");
+}
+
+static void test_irregular_rows_2(struct tetris_game *g) {
+        reset_playfield(g);
 
         int x,y;
         //XXXXXXXXXX
@@ -1907,85 +4920,757 @@ static void test_irregular_rows_2(void) {
         y = TETRIS_PLAYFIELD_Y-1;
 
         for (x=0; x<TETRIS_PLAYFIELD_X; x++)
-                playfield[y-0][x] = TETRIS_COLOR_RED;
+                set_cell(g, x, y-0, TETRIS_COLOR_RED);
         for (x=0; x<TETRIS_PLAYFIELD_X; x++)
-                playfield[y-1][x] = TETRIS_COLOR_RED;
+                set_cell(g, x, y-1, TETRIS_COLOR_RED);
         for (x=0; x<TETRIS_PLAYFIELD_X; x++)
-                playfield[y-2][x] = TETRIS_COLOR_RED;
+                set_cell(g, x, y-2, TETRIS_COLOR_RED);
         x=0;
-        playfield[y-2][x+3] = TETRIS_COLOR_BLACK;
-        playfield[y-3][x+1] = TETRIS_COLOR_RED;
-        playfield[y-3][x+4] = TETRIS_COLOR_RED;
-        playfield[y-3][x+5] = TETRIS_COLOR_RED;
-        playfield[y-3][x+6] = TETRIS_COLOR_RED;
-        playfield[y-3][x+7] = TETRIS_COLOR_RED;
-        playfield[y-4][x+6] = TETRIS_COLOR_RED;
-        playfield[y-5][x+6] = TETRIS_COLOR_RED;
-        
-        int nlines = clear_full_lines();
+        set_cell(g, x+3, y-2, TETRIS_COLOR_BLACK);
+        set_cell(g, x+1, y-3, TETRIS_COLOR_RED);
+        set_cell(g, x+4, y-3, TETRIS_COLOR_RED);
+        set_cell(g, x+5, y-3, TETRIS_COLOR_RED);
+        set_cell(g, x+6, y-3, TETRIS_COLOR_RED);
+        set_cell(g, x+7, y-3, TETRIS_COLOR_RED);
+        set_cell(g, x+6, y-4, TETRIS_COLOR_RED);
+        set_cell(g, x+6, y-5, TETRIS_COLOR_RED);
+        
+        int nlines = clear_full_lines(g, TETRIS_PLAYFIELD_Y-4, TETRIS_PLAYFIELD_Y-1);
         test_assert_eq(2, nlines, "Irregular rows, nlines");
+        test_assert_eq(TETRIS_PLAYFIELD_Y-1, g->last_line_clear.rows[0], "Irregular rows, cleared row");
+        test_assert_eq(TETRIS_PLAYFIELD_Y-2, g->last_line_clear.rows[1], "Irregular rows, cleared row");
+        test_assert_eq(TETRIS_PLAYFIELD_Y-4, g->playfield_top, "Irregular rows, stack top");
 
         for (y=0; y<TETRIS_PLAYFIELD_Y-4; y++) {
                 for (x=0; x<TETRIS_PLAYFIELD_X; x++) {
-                        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y][x], "Irreglar rows, empty");
+                        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x, y), "Irreglar rows, empty");
                 }
         }
         
         x = 0;
         y = TETRIS_PLAYFIELD_Y-1;
 
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+0], "Irregular rows 2, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+1], "Irregular rows 2, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+2], "Irregular rows 2, 1");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-0][x+3], "Irregular rows 2, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+4], "Irregular rows 2, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+5], "Irregular rows 2, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+6], "Irregular rows 2, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+7], "Irregular rows 2, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+8], "Irregular rows 2, 1");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-0][x+9], "Irregular rows 2, 1");
-        
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+0], "Irregular rows 2, 2");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-1][x+1], "Irregular rows 2, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+2], "Irregular rows 2, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+3], "Irregular rows 2, 2");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-1][x+4], "Irregular rows 2, 2");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-1][x+5], "Irregular rows 2, 2");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-1][x+6], "Irregular rows 2, 2");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-1][x+7], "Irregular rows 2, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+8], "Irregular rows 2, 2");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-1][x+9], "Irregular rows 2, 2");
-        
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+0], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+1], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+2], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+3], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+4], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+5], "Irregular rows 2, 3");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-2][x+6], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+7], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+8], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-2][x+9], "Irregular rows 2, 3");
-        
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+0], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+1], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+2], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+3], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+4], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+5], "Irregular rows 2, 3");
-        test_assert_diff(TETRIS_COLOR_BLACK, playfield[y-3][x+6], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+7], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+8], "Irregular rows 2, 3");
-        test_assert_eq(TETRIS_COLOR_BLACK, playfield[y-3][x+9], "Irregular rows 2, 3");
-}
-
-static void test_row_clear(void) {
-        test_single_row();
-        test_double_row();
-        test_triple_row();
-        test_tetris_row();
-        test_irregular_rows();
-        test_irregular_rows_2();
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+0, y-0), "Irregular rows 2, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+1, y-0), "Irregular rows 2, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+2, y-0), "Irregular rows 2, 1");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+3, y-0), "Irregular rows 2, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+4, y-0), "Irregular rows 2, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+5, y-0), "Irregular rows 2, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+6, y-0), "Irregular rows 2, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+7, y-0), "Irregular rows 2, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+8, y-0), "Irregular rows 2, 1");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+9, y-0), "Irregular rows 2, 1");
+        
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+0, y-1), "Irregular rows 2, 2");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+1, y-1), "Irregular rows 2, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+2, y-1), "Irregular rows 2, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+3, y-1), "Irregular rows 2, 2");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+4, y-1), "Irregular rows 2, 2");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+5, y-1), "Irregular rows 2, 2");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+6, y-1), "Irregular rows 2, 2");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+7, y-1), "Irregular rows 2, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+8, y-1), "Irregular rows 2, 2");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+9, y-1), "Irregular rows 2, 2");
+        
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+0, y-2), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+1, y-2), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+2, y-2), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+3, y-2), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+4, y-2), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+5, y-2), "Irregular rows 2, 3");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+6, y-2), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+7, y-2), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+8, y-2), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+9, y-2), "Irregular rows 2, 3");
+        
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+0, y-3), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+1, y-3), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+2, y-3), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+3, y-3), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+4, y-3), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+5, y-3), "Irregular rows 2, 3");
+        test_assert_diff(TETRIS_COLOR_BLACK, test_cell(g, x+6, y-3), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+7, y-3), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+8, y-3), "Irregular rows 2, 3");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, x+9, y-3), "Irregular rows 2, 3");
+}
+
+static void test_shapes(struct tetris_game *g) {
+        const struct piece_shape *i = &piece_shapes[TETRIMINO_I][CLOCKWISE_ROTATED];
+        test_assert_eq(0, i->top, "I shape, top");
+        test_assert_eq(3, i->bottom, "I shape, bottom");
+        test_assert_eq(2, i->left, "I shape, left");
+        test_assert_eq(2, i->right, "I shape, right");
+        test_assert_eq(ROW(0,0,1,0), i->rows[3], "I shape, row");
+
+        const struct piece_shape *l = &piece_shapes[TETRIMINO_L][TWICE_ROTATED];
+        test_assert_eq(1, l->top, "L shape, top");
+        test_assert_eq(2, l->bottom, "L shape, bottom");
+        test_assert_eq(0, l->left, "L shape, left");
+        test_assert_eq(2, l->right, "L shape, right");
+        test_assert_eq(ROW(1,0,0,0), l->rows[2], "L shape, row");
+
+        reset_playfield(g);
+        lock_piece(g, TETRIMINO_L, TWICE_ROTATED, (struct point){0, 30});
+        test_assert_eq(TETRIS_COLOR_ORANGE, test_cell(g, 0, 31), "L shape, lock");
+        test_assert_eq(TETRIS_COLOR_ORANGE, test_cell(g, 2, 31), "L shape, lock");
+        test_assert_eq(TETRIS_COLOR_ORANGE, test_cell(g, 0, 32), "L shape, lock");
+        test_assert_eq(TETRIS_COLOR_BLACK, test_cell(g, 1, 32), "L shape, lock");
+
+        fprintf(stderr, "Shapes are correct\n");
+}
+
+static void test_collision(struct tetris_game *g) {
+        reset_playfield(g);
+
+        test_assert_eq(false, collision(g, TETRIMINO_I, SPAWN_ROTATED, (struct point){0, 20}), "Collision, left wall");
+        test_assert_eq(true, collision(g, TETRIMINO_I, SPAWN_ROTATED, (struct point){-1, 20}), "Collision, left wall");
+        test_assert_eq(false, collision(g, TETRIMINO_I, SPAWN_ROTATED, (struct point){6, 20}), "Collision, right wall");
+        test_assert_eq(true, collision(g, TETRIMINO_I, SPAWN_ROTATED, (struct point){7, 20}), "Collision, right wall");
+        test_assert_eq(false, collision(g, TETRIMINO_I, CLOCKWISE_ROTATED, (struct point){-2, 20}), "Collision, left wall vertical");
+        test_assert_eq(true, collision(g, TETRIMINO_I, CLOCKWISE_ROTATED, (struct point){-3, 20}), "Collision, left wall vertical");
+        test_assert_eq(false, collision(g, TETRIMINO_I, SPAWN_ROTATED, (struct point){3, TETRIS_PLAYFIELD_Y-2}), "Collision, floor");
+        test_assert_eq(true, collision(g, TETRIMINO_I, SPAWN_ROTATED, (struct point){3, TETRIS_PLAYFIELD_Y-1}), "Collision, floor");
+
+        set_cell(g, 4, 30, TETRIS_COLOR_RED);
+        test_assert_eq(true, collision(g, TETRIMINO_T, SPAWN_ROTATED, (struct point){3, 29}), "Collision, block");
+        test_assert_eq(false, collision(g, TETRIMINO_T, SPAWN_ROTATED, (struct point){3, 28}), "Collision, block");
+        test_assert_eq(false, collision(g, TETRIMINO_T, SPAWN_ROTATED, (struct point){5, 29}), "Collision, block");
+        set_cell(g, 4, 30, TETRIS_COLOR_BLACK);
+        test_assert_eq(false, collision(g, TETRIMINO_T, SPAWN_ROTATED, (struct point){3, 29}), "Collision, cleared block");
+
+        fprintf(stderr, "Collision is correct\n");
+}
+
+// An I piece rotating clockwise from spawn, with a block right under where
+// it would end up, gets kicked differently by each rotation system
+static void test_rotation_kick(struct tetris_game *g, enum tetris_rotation_system system, int expected_x, enum tetrimino_rotation expected_rotation, char *msg) {
+        reset_playfield(g);
+        set_cell(g, 5, 23, TETRIS_COLOR_RED);
+        
+        tetris_game_set_rotation_system(g, system);
+        g->current_piece = TETRIMINO_I;
+        g->current_piece_rotation = SPAWN_ROTATED;
+        g->current_piece_location = (struct point){3, 20};
+        
+        test_assert_eq(expected_rotation != SPAWN_ROTATED, rotate(g, ROTATE_CLOCKWISE), msg);
+        test_assert_eq(expected_x, g->current_piece_location.x, msg);
+        test_assert_eq(20, g->current_piece_location.y, msg);
+        test_assert_eq(expected_rotation, g->current_piece_rotation, msg);
+}
+
+static void test_rotation(struct tetris_game *g) {
+        test_rotation_kick(g, TETRIS_ROTATION_SRS, 1, CLOCKWISE_ROTATED, "Rotation, SRS I kick");
+        test_rotation_kick(g, TETRIS_ROTATION_SRS_PLUS, 4, CLOCKWISE_ROTATED, "Rotation, SRS+ I kick");
+        test_rotation_kick(g, TETRIS_ROTATION_ARS, 3, SPAWN_ROTATED, "Rotation, ARS I doesn't kick");
+
+        // Four turns either way come back to the start when nothing is in the way
+        reset_playfield(g);
+        tetris_game_set_rotation_system(g, TETRIS_ROTATION_SRS);
+        g->current_piece = TETRIMINO_T;
+        g->current_piece_rotation = SPAWN_ROTATED;
+        g->current_piece_location = (struct point){3, 20};
+        for (int i=0; i<4; i++)
+                test_assert_eq(true, rotate(g, ROTATE_COUNTERCLOCKWISE), "Rotation, counterclockwise");
+        test_assert_eq(SPAWN_ROTATED, g->current_piece_rotation, "Rotation, full turn");
+        test_assert_eq(3, g->current_piece_location.x, "Rotation, full turn x");
+        test_assert_eq(20, g->current_piece_location.y, "Rotation, full turn y");
+
+        fprintf(stderr, "Rotation is correct\n");
+}
+
+static void test_split_rows(struct tetris_game *g) {
+        reset_playfield(g);
+
+        //X_________
+        //XXXXXXXXXX
+        //__X_______
+        //XXXXXXXXXX
+        int y = TETRIS_PLAYFIELD_Y-1;
+        for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
+                set_cell(g, x, y-0, TETRIS_COLOR_RED);
+                set_cell(g, x, y-2, TETRIS_COLOR_RED);
+        }
+        set_cell(g, 2, y-1, TETRIS_COLOR_BLUE);
+        set_cell(g, 0, y-3, TETRIS_COLOR_GREEN);
+
+        int nlines = clear_full_lines(g, TETRIS_PLAYFIELD_Y-4, TETRIS_PLAYFIELD_Y-1);
+        test_assert_eq(2, nlines, "Split rows, nlines");
+        test_assert_eq(y-0, g->last_line_clear.rows[0], "Split rows, cleared row");
+        test_assert_eq(y-2, g->last_line_clear.rows[1], "Split rows, cleared row");
+
+        for (int j=0; j<TETRIS_PLAYFIELD_Y; j++) {
+                for (int x=0; x<TETRIS_PLAYFIELD_X; x++) {
+                        enum tetris_color expected = TETRIS_COLOR_BLACK;
+                        if (j == y-0 && x == 2)
+                                expected = TETRIS_COLOR_BLUE;
+                        if (j == y-1 && x == 0)
+                                expected = TETRIS_COLOR_GREEN;
+                        test_assert_eq(expected, test_cell(g, x, j), "Split rows, playfield");
+                }
+        }
+}
+
+static void test_surface(struct tetris_game *g) {
+        reset_playfield(g);
+
+        int y = TETRIS_PLAYFIELD_Y-1;
+        test_assert_eq(18, drop_distance(g, TETRIMINO_T, SPAWN_ROTATED, (struct point){3, 20}), "Surface, empty");
+
+        //____X_____
+        //__________
+        //XXXXXXXX__
+        //_X________
+        set_cell(g, 1, y, TETRIS_COLOR_RED);
+        for (int x=0; x<8; x++)
+                set_cell(g, x, y-1, TETRIS_COLOR_RED);
+        set_cell(g, 4, y-3, TETRIS_COLOR_RED);
+
+        test_assert_eq(y-3, g->column_tops[4], "Surface, column top");
+        test_assert_eq(y-1, g->column_tops[1], "Surface, column top");
+        test_assert_eq(TETRIS_PLAYFIELD_Y, g->column_tops[9], "Surface, column top");
+        test_assert_eq((y-3)-23-1, drop_distance(g, TETRIMINO_I, CLOCKWISE_ROTATED, (struct point){2, 20}), "Surface, profile");
+        test_assert_eq(-1, drop_distance(g, TETRIMINO_I, CLOCKWISE_ROTATED, (struct point){2, y-6}), "Surface, collides");
+        
+        // under the overhang, so it has to be probed
+        test_assert_eq(0, drop_distance(g, TETRIMINO_I, SPAWN_ROTATED, (struct point){3, y-3}), "Surface, overhang");
+        test_assert_eq(2, drop_distance(g, TETRIMINO_O, SPAWN_ROTATED, (struct point){7, y-3}), "Surface, well");
+
+        lock_piece(g, TETRIMINO_O, SPAWN_ROTATED, (struct point){7, y-2});
+        test_assert_eq(1, clear_full_lines(g, y-2, y-1), "Surface, clear");
+        test_assert_eq(y-2, g->column_tops[4], "Surface, cleared column top");
+        test_assert_eq(y, g->column_tops[1], "Surface, cleared column top");
+        test_assert_eq(y-1, g->column_tops[8], "Surface, cleared column top");
+        test_assert_eq(TETRIS_PLAYFIELD_Y, g->column_tops[0], "Surface, cleared column top");
+        test_assert_eq(y-2, g->playfield_top, "Surface, cleared stack top");
+
+        fprintf(stderr, "Surface is correct\n");
+}
+
+static void test_gravity(void) {
+        for (int i=1; i<GRAVITY_LEVELS; i++)
+                test_assert_eq(true, gravity_table[i] > gravity_table[i-1], "Gravity, faster every level");
+        test_assert_eq(true, gravity_table[GRAVITY_LEVELS-1] >= GRAVITY_20G, "Gravity, last level is 20G");
+        
+        struct tetris_game g;
+        tetris_game_init(&g, 7);
+        int ticks = 0;
+        while (g.current_piece_location.y == 20) {
+                tetris_game_tick(&g);
+                ticks++;
+        }
+        test_assert_eq((GRAVITY_ONE_ROW + gravity_table[0] - 1) / gravity_table[0], ticks, "Gravity, level 1");
+        test_assert_eq(21, g.current_piece_location.y, "Gravity, level 1 row");
+
+        tetris_game_init(&g, 7);
+        g.level = 100;
+        int shadow = g.current_shadow_location.y;
+        tetris_game_tick(&g);
+        test_assert_eq(shadow, g.current_piece_location.y, "Gravity, 20G drop");
+        test_assert_eq(TETRIS_PLAYFIELD_Y, g.playfield_top, "Gravity, 20G not locked yet");
+        tetris_game_tick(&g);
+        test_assert_eq(20, g.current_piece_location.y, "Gravity, 20G lock");
+        test_assert_diff(TETRIS_PLAYFIELD_Y, g.playfield_top, "Gravity, 20G locked");
+        
+        fprintf(stderr, "Gravity is correct\n");
+}
+
+static void test_independent_games(void) {
+        static const enum input_type inputs[] = {
+                INPUT_LEFT, INPUT_CLOCKWISE_ROTATION, INPUT_HARD_DROP, INPUT_HOLD,
+                INPUT_RIGHT, INPUT_RIGHT, INPUT_SOFT_DROP, INPUT_HARD_DROP
+        };
+        
+        struct tetris_game a, b, c;
+        tetris_game_init(&a, 42);
+        tetris_game_init(&b, 42);
+        tetris_game_init(&c, 42);
+
+        for (int i=0; i<2000; i++) {
+                tetris_game_input(&a, inputs[i % 8]);
+                tetris_game_tick(&a);
+        }
+        test_assert_eq(0, memcmp(&b, &c, sizeof(b)), "Independent games, untouched");
+        
+        for (int i=0; i<2000; i++) {
+                tetris_game_input(&b, inputs[i % 8]);
+                tetris_game_tick(&b);
+        }
+        test_assert_eq(0, memcmp(&a, &b, sizeof(a)), "Independent games, same seed");
+        test_assert_diff(0, a.score, "Independent games, score");
+
+        fprintf(stderr, "Games are independent\n");
+}
+
+static void test_unchanged_inputs(void) {
+        struct tetris_game g, before;
+        tetris_game_init(&g, 5);
+
+        // Pushed into the wall, the last move doesn't change anything
+        int moves = 0;
+        while (tetris_game_input(&g, INPUT_LEFT))
+                moves++;
+        test_assert_diff(0, moves, "Unchanged inputs, moves to the wall");
+        before = g;
+        test_assert_eq(false, tetris_game_input(&g, INPUT_LEFT), "Unchanged inputs, into the wall");
+        test_assert_eq(0, memcmp(&g, &before, sizeof(g)), "Unchanged inputs, wall left alone");
+
+        test_assert_eq(true, tetris_game_input(&g, INPUT_HOLD), "Unchanged inputs, hold");
+        before = g;
+        test_assert_eq(false, tetris_game_input(&g, INPUT_HOLD), "Unchanged inputs, second hold");
+        test_assert_eq(0, memcmp(&g, &before, sizeof(g)), "Unchanged inputs, hold left alone");
+
+        test_assert_eq(true, tetris_game_input(&g, INPUT_PAUSE), "Unchanged inputs, pause");
+        before = g;
+        test_assert_eq(false, tetris_game_input(&g, INPUT_RIGHT), "Unchanged inputs, paused");
+        test_assert_eq(0, memcmp(&g, &before, sizeof(g)), "Unchanged inputs, paused left alone");
+        test_assert_eq(true, tetris_game_input(&g, INPUT_PAUSE), "Unchanged inputs, unpause");
+
+        fprintf(stderr, "Unchanged inputs are refused\n");
+}
+
+static void test_held_actions(void) {
+        struct tetris_game g;
+        tetris_game_init(&g, 3);
+        terminal.kitty = true;
+        long now = 1000000;
+
+        // Soft drop has no DAS: one row on the press, the next an ARR later
+        int y = g.current_piece_location.y;
+        struct key_event ev = {KEY_DOWN, KEY_EVENT_PRESS};
+        handle_key_event(&g, &ev, now);
+        update_held_actions(&g, now);
+        test_assert_eq(y + 1, g.current_piece_location.y, "Held actions, soft drop press");
+        update_held_actions(&g, now + action_timings[INPUT_SOFT_DROP].arr_us - 1);
+        test_assert_eq(y + 1, g.current_piece_location.y, "Held actions, soft drop before ARR");
+        update_held_actions(&g, now + action_timings[INPUT_SOFT_DROP].arr_us);
+        test_assert_eq(y + 2, g.current_piece_location.y, "Held actions, soft drop repeat");
+        ev.type = KEY_EVENT_RELEASE;
+        handle_key_event(&g, &ev, now + 100000);
+        update_held_actions(&g, now + 200000);
+        test_assert_eq(y + 2, g.current_piece_location.y, "Held actions, soft drop released");
+        
+        // Left waits out its DAS
+        int x = g.current_piece_location.x;
+        ev = (struct key_event){KEY_LEFT, KEY_EVENT_PRESS};
+        handle_key_event(&g, &ev, now);
+        update_held_actions(&g, now);
+        test_assert_eq(x - 1, g.current_piece_location.x, "Held actions, left press");
+        update_held_actions(&g, now + action_timings[INPUT_LEFT].das_us);
+        test_assert_eq(x - 2, g.current_piece_location.x, "Held actions, left after DAS");
+
+        memset(held_actions, 0, sizeof(held_actions));
+        terminal.kitty = false;
+
+        // Without releases, two quick taps move twice and no more
+        tetris_game_init(&g, 3);
+        x = g.current_piece_location.x;
+        ev = (struct key_event){KEY_LEFT, KEY_EVENT_PRESS};
+        for (long t=now; t<now + 300000; t+=10000) {
+                if (t == now || t == now + 60000)
+                        handle_key_event(&g, &ev, t);
+                update_held_actions(&g, t);
+        }
+        test_assert_eq(x - 2, g.current_piece_location.x, "Held actions, legacy taps");
+
+        // A key the terminal keeps repeating for long enough is held
+        now += 1000000;
+        for (long t=now; t<now + 400000; t+=30000) {
+                handle_key_event(&g, &ev, t);
+                update_held_actions(&g, t);
+        }
+        test_assert_eq(true, held_actions[INPUT_LEFT].repeating, "Held actions, legacy repeat");
+
+        // With no ARR, a piece held against the wall records nothing more
+        memset(held_actions, 0, sizeof(held_actions));
+        const struct action_timing left = action_timings[INPUT_LEFT];
+        action_timings[INPUT_LEFT] = (struct action_timing){0, 0};
+        terminal.kitty = true;
+        tetris_game_init(&g, 3);
+        x = g.current_piece_location.x;
+        replay_start(&recorder, tmpfile(), 3, TETRIS_ROTATION_SRS);
+        long start = ftell(recorder.f);
+        handle_key_event(&g, &ev, now);
+        for (int i=0; i<100; i++)
+                update_held_actions(&g, now + i * 1000);
+        test_assert_diff(x, g.current_piece_location.x, "Held actions, no ARR moves");
+        test_assert_eq(x - g.current_piece_location.x, ftell(recorder.f) - start, "Held actions, no ARR at the wall");
+        fclose(recorder.f);
+        recorder.f = NULL;
+        action_timings[INPUT_LEFT] = left;
+        terminal.kitty = false;
+
+        memset(held_actions, 0, sizeof(held_actions));
+        
+        fprintf(stderr, "Held actions are correct\n");
+}
+
+static void test_ansi_present(void) {
+        static struct frame f, shown;
+        frame_resize(&f, 8, 2);
+        frame_resize(&shown, 8, 2);
+        ansi_resize(&ansi, 8, 2);
+        int fds[2];
+        test_assert_eq(0, pipe(fds), "ANSI, pipe");
+        
+        ansi.fd = fds[1];
+        frame_text(&f, 0, 0, false, "ab");
+        frame_present_ansi(&f, &shown);
+        char out[256];
+        ssize_t n = read(fds[0], out, sizeof(out) - 1);
+        out[n > 0 ? n : 0] = '\0';
+        test_assert_eq(true, strstr(out, "ab") != NULL, "ANSI, sent");
+        test_assert_eq(true, frame_cell_equal(&f.cells[1], &shown.cells[1]), "ANSI, shown");
+
+        // What couldn't be written is sent again with the next frame
+        ansi.fd = -1;
+        frame_text(&f, 0, 1, false, "cd");
+        frame_present_ansi(&f, &shown);
+        test_assert_eq(false, frame_cell_equal(&f.cells[1], &shown.cells[1]), "ANSI, failed write forgotten");
+
+        // Code points take as few UTF-8 bytes as they can
+        ansi.fd = fds[1];
+        frame_resize(&shown, 8, 2);
+        frame_put(&f, 0, 0, 0xe9, TETRIS_COLOR_WHITE, TETRIS_COLOR_BLACK, false);
+        frame_put(&f, 1, 0, 0x2580, TETRIS_COLOR_WHITE, TETRIS_COLOR_BLACK, false);
+        frame_present_ansi(&f, &shown);
+        n = read(fds[0], out, sizeof(out) - 1);
+        out[n > 0 ? n : 0] = '\0';
+        test_assert_eq(true, strstr(out, "\xc3\xa9\xe2\x96\x80") != NULL, "ANSI, UTF-8");
+        
+        ansi.fd = STDOUT_FILENO;
+        close(fds[0]);
+        close(fds[1]);
+        
+        fprintf(stderr, "ANSI frames are correct\n");
+}
+
+static void *test_trace_span(void *arg) {
+        (void)arg;
+        trace_begin(TRACE_CLEAR_LINES);
+        trace_end(TRACE_CLEAR_LINES);
+        return NULL;
+}
+
+static void test_trace_threads(void) {
+        trace_log.events = calloc(TRACE_EVENTS, sizeof(*trace_log.events));
+        test_assert_eq(true, trace_log.events != NULL, "Trace, buffer");
+        trace_log.next = 0;
+
+        // A span of the same name on another thread doesn't cut this one short
+        trace_begin(TRACE_CLEAR_LINES);
+        struct timespec ts = {0, 2000000};
+        nanosleep(&ts, NULL);
+        pthread_t thread;
+        test_assert_eq(0, pthread_create(&thread, NULL, test_trace_span, NULL), "Trace, thread");
+        pthread_join(thread, NULL);
+        trace_end(TRACE_CLEAR_LINES);
+        test_assert_eq(2, trace_log.next, "Trace, spans");
+        test_assert_eq(true, trace_log.events[1].dur_ns >= ts.tv_nsec, "Trace, span per thread");
+        test_assert_eq(true, trace_log.events[0].ts_ns > trace_log.events[1].ts_ns, "Trace, other thread's span");
+
+        free(trace_log.events);
+        trace_log.events = NULL;
+        trace_log.next = 0;
+        
+        fprintf(stderr, "Trace spans are correct\n");
+}
+
+static void test_snapshots(void) {
+        struct snapshot_buffer b = {.back = 0, .middle = 1, .front = 2, .wakeup = -1};
+
+        b.slots[2].hiscore = -1;
+        test_assert_eq(-1, snapshot_latest(&b)->hiscore, "Snapshots, nothing published");
+        
+        snapshot_back(&b)->hiscore = 1;
+        snapshot_publish(&b);
+        test_assert_eq(1, snapshot_latest(&b)->hiscore, "Snapshots, first");
+        test_assert_eq(1, snapshot_latest(&b)->hiscore, "Snapshots, first again");
+
+        // The renderer only ever sees the latest, and what it's drawing
+        // never gets written over
+        for (int i=2; i<=5; i++) {
+                snapshot_back(&b)->hiscore = i;
+                snapshot_publish(&b);
+                test_assert_diff(b.front, b.back, "Snapshots, slots in use");
+        }
+        test_assert_eq(5, snapshot_latest(&b)->hiscore, "Snapshots, latest");
+        test_assert_diff(b.front, b.back, "Snapshots, slots after reading");
+        test_assert_diff(b.front, b.middle & ~SNAPSHOT_FRESH, "Snapshots, middle after reading");
+        
+        fprintf(stderr, "Snapshots are correct\n");
+}
+
+static void test_leaderboard(void) {
+        struct leaderboard lb;
+        test_assert_eq(true, leaderboard_read("/nonexistent/leaderboard.bin", &lb), "Leaderboard, missing file");
+        test_assert_eq(0, lb.count, "Leaderboard, missing file is empty");
+
+        // Scores go in out of order, ties after the ones already there
+        for (int i=0; i<LEADERBOARD_ENTRIES; i++) {
+                struct game_record e = {.score = (i * 7) % LEADERBOARD_ENTRIES * 100, .lines = i};
+                test_assert_eq(true, leaderboard_insert(&lb, &e), "Leaderboard, insert while not full");
+        }
+        test_assert_eq(LEADERBOARD_ENTRIES, lb.count, "Leaderboard, full");
+        for (int i=1; i<LEADERBOARD_ENTRIES; i++)
+                test_assert_eq(true, lb.entries[i-1].score >= lb.entries[i].score, "Leaderboard, best first");
+
+        struct game_record low = {.score = 0};
+        test_assert_eq(false, leaderboard_insert(&lb, &low), "Leaderboard, too low when full");
+        struct game_record tie = {.score = 900, .lines = 99};
+        test_assert_eq(true, leaderboard_insert(&lb, &tie), "Leaderboard, tie with the best");
+        test_assert_eq(99, lb.entries[1].lines, "Leaderboard, tie goes after");
+        test_assert_eq(LEADERBOARD_ENTRIES, lb.count, "Leaderboard, still full");
+        test_assert_eq(100, lb.entries[LEADERBOARD_ENTRIES-1].score, "Leaderboard, worst dropped");
+
+        // What's written is read back the same
+        char filename[] = "/tmp/tetrominoes-leaderboard-XXXXXX";
+        int fd = mkstemp(filename);
+        test_assert_eq(true, fd != -1 && write(fd, &lb, sizeof(lb)) == sizeof(lb), "Leaderboard, write");
+        close(fd);
+        struct leaderboard read;
+        test_assert_eq(true, leaderboard_read(filename, &read), "Leaderboard, read");
+        test_assert_eq(0, memcmp(&lb, &read, sizeof(lb)), "Leaderboard, read back");
+        truncate(filename, sizeof(lb) - 1);
+        test_assert_eq(false, leaderboard_read(filename, &read), "Leaderboard, short file");
+        unlink(filename);
+
+        fprintf(stderr, "Leaderboard is correct\n");
+}
+
+static void test_history(void) {
+        // Scores out of order and dates in order, some of them the same
+        struct game_record records[8];
+        for (int i=0; i<8; i++)
+                records[i] = (struct game_record){.score = (i * 5) % 8 * 10, .date = 1000 + i / 2, .lines = i, .level = 1, .duration_s = 60};
+        
+        struct history h;
+        memset(&h, 0, sizeof(h));
+        history_index_reset(&h.header);
+        h.records = records;
+        h.count = 5;
+        test_assert_eq(true, history_index_update(&h), "History, first update");
+        test_assert_eq(false, history_index_update(&h), "History, already up to date");
+        h.count = 8;
+        test_assert_eq(true, history_index_update(&h), "History, appended");
+
+        test_assert_eq(8, h.header.count, "History, indexed");
+        test_assert_eq(280, h.header.total_score, "History, total score");
+        test_assert_eq(7, h.header.best_lines, "History, best lines");
+        test_assert_eq(480, h.header.total_duration_s, "History, total time");
+        for (int i=1; i<8; i++)
+                test_assert_eq(true, records[h.by_score[i-1]].score <= records[h.by_score[i]].score, "History, by score");
+        
+        test_assert_eq(0, history_percentile(&h, 0), "History, lowest");
+        test_assert_eq(30, history_percentile(&h, 50), "History, median");
+        test_assert_eq(70, history_percentile(&h, 100), "History, highest");
+        test_assert_eq(0, history_since(&h, 0), "History, since forever");
+        test_assert_eq(4, history_since(&h, 1002), "History, since a date");
+        test_assert_eq(8, history_since(&h, 2000), "History, since later");
+        
+        free(h.by_score);
+
+        fprintf(stderr, "History is correct\n");
+}
+
+static void test_saved_game(void) {
+        struct tetris_game g;
+        tetris_game_init(&g, 7);
+        static struct saved_game s;
+        saved_game_fill(&s, &g, 1000);
+        test_assert_eq(true, saved_game_is_valid(&s), "Saved game, new game");
+
+        // Played for a while, with pieces locked and held
+        for (int i=0; i<200; i++) {
+                tetris_game_input(&g, i % 7 == 0 ? INPUT_HOLD : i % 3 == 0 ? INPUT_HARD_DROP : INPUT_LEFT);
+                tetris_game_tick(&g);
+        }
+        saved_game_fill(&s, &g, 1000);
+        test_assert_eq(true, saved_game_is_valid(&s), "Saved game, played");
+        test_assert_eq(0, memcmp(&s.game, &g, sizeof(g)), "Saved game, same game");
+
+        s.game.score++;
+        test_assert_eq(false, saved_game_is_valid(&s), "Saved game, corrupt");
+        s.game.score--;
+        s.version++;
+        test_assert_eq(false, saved_game_is_valid(&s), "Saved game, other version");
+        
+        // Checksums only catch damage, not a game that can't go on
+        saved_game_fill(&s, &g, 1000);
+        s.game.current_piece_location.y = -1;
+        s.checksum = saved_game_checksum(&s);
+        test_assert_eq(false, saved_game_is_valid(&s), "Saved game, piece out of the playfield");
+        saved_game_fill(&s, &g, 1000);
+        s.game.spawn_next_i = 9;
+        s.checksum = saved_game_checksum(&s);
+        test_assert_eq(false, saved_game_is_valid(&s), "Saved game, past the bag");
+        saved_game_fill(&s, &g, 1000);
+        s.game.column_tops[3]--;
+        s.checksum = saved_game_checksum(&s);
+        test_assert_eq(false, saved_game_is_valid(&s), "Saved game, wrong column top");
+
+        fprintf(stderr, "Saved games are correct\n");
+}
+
+// Saved games go to a new directory of their own until test_data_end().
+// Returns what XDG_DATA_HOME was, to go back to.
+static char *test_data_begin(char dir[]) {
+        char *data_home = getenv("XDG_DATA_HOME");
+        if (data_home != NULL)
+                data_home = strdup(data_home);
+        test_assert_eq(true, mkdtemp(dir) != NULL, "Test data directory");
+        setenv("XDG_DATA_HOME", dir, 1);
+        return data_home;
+}
+
+static void test_data_end(const char *dir, char *data_home) {
+        static const char *names[] = {SAVE_FILE, HISTORY_FILE, HISTORY_INDEX_FILE, LEADERBOARD_FILE, DATA_LOCK_FILE, "tetrominoes"};
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        for (size_t i=0; i<sizeof(names)/sizeof(*names); i++) {
+                if (get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, names[i]))
+                        remove(filename);
+        }
+        rmdir(dir);
+        if (data_home != NULL)
+                setenv("XDG_DATA_HOME", data_home, 1);
+        else
+                unsetenv("XDG_DATA_HOME");
+        free(data_home);
+}
+
+static void test_history_checkpoints(void) {
+        char dir[] = "/tmp/tetrominoes-data-XXXXXX";
+        char *data_home = test_data_begin(dir);
+        static char filename[MAX_TOTAL_HISCORE_FILEPATH_LENGTH];
+        static struct game_record records[HISTORY_INDEX_INTERVAL];
+        for (int i=0; i<HISTORY_INDEX_INTERVAL; i++)
+                records[i] = (struct game_record){.score = (i * 37) % 101, .date = 1000 + i, .level = 1};
+
+        // Games are only appended until the history reaches the interval
+        get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, HISTORY_FILE);
+        int lock = lock_data(LOCK_EX);
+        FILE *f = fopen(filename, "wb");
+        test_assert_eq(true, f != NULL, "History checkpoints, history");
+        fwrite(records, sizeof(*records), HISTORY_INDEX_INTERVAL - 2, f);
+        fclose(f);
+        test_assert_eq(true, history_add(&records[HISTORY_INDEX_INTERVAL - 2]), "History checkpoints, add");
+        get_data_filename(filename, MAX_TOTAL_HISCORE_FILEPATH_LENGTH, HISTORY_INDEX_FILE);
+        test_assert_eq(-1, access(filename, F_OK), "History checkpoints, not yet");
+        test_assert_eq(true, history_add(&records[HISTORY_INDEX_INTERVAL - 1]), "History checkpoints, add at the interval");
+        test_assert_eq(0, access(filename, F_OK), "History checkpoints, index written");
+        unlock_data(lock);
+
+        struct history h;
+        test_assert_eq(true, history_open(&h), "History checkpoints, open");
+        test_assert_eq(HISTORY_INDEX_INTERVAL, h.header.count, "History checkpoints, indexed");
+        test_assert_eq(false, history_index_update(&h), "History checkpoints, up to date");
+        test_assert_eq(100, history_percentile(&h, 100), "History checkpoints, best");
+        history_close(&h);
+
+        test_data_end(dir, data_home);
+        
+        fprintf(stderr, "History checkpoints are correct\n");
+}
+
+static void test_recording_keeps_save(void) {
+        char dir[] = "/tmp/tetrominoes-data-XXXXXX";
+        char *data_home = test_data_begin(dir);
+
+        struct tetris_game saved, recorded, resumed;
+        tetris_game_init(&saved, 11);
+        tetris_game_input(&saved, INPUT_HARD_DROP);
+        tetris_game_tick(&saved);
+        int lock = lock_data(LOCK_EX);
+        test_assert_eq(true, lock != -1 && save_game(&saved, 1000000), "Recording, saved game");
+        unlock_data(lock);
+
+        // Quitting a recording part way goes into the history instead
+        tetris_game_init(&recorded, 12);
+        played.game = &recorded;
+        played.start_us = now_us();
+        played.recording = true;
+        save_hiscore();
+        played.game = NULL;
+        played.recording = false;
+
+        struct history h;
+        test_assert_eq(true, history_open(&h), "Recording, history");
+        test_assert_eq(1, h.count, "Recording, in the history");
+        history_close(&h);
+        test_assert_eq(1000000, resume_game(&resumed), "Recording, saved game kept");
+        resumed.paused = saved.paused;
+        test_assert_eq(0, memcmp(&saved, &resumed, sizeof(saved)), "Recording, same saved game");
+
+        test_data_end(dir, data_home);
+
+        fprintf(stderr, "Recordings keep the saved game\n");
+}
+
+static void test_replay(void) {
+        FILE *f = tmpfile();
+        struct replay_recorder r;
+        struct tetris_game g, replayed;
+        tetris_game_init(&g, 42);
+        tetris_game_set_rotation_system(&g, TETRIS_ROTATION_ARS);
+        replay_start(&r, f, 42, TETRIS_ROTATION_ARS);
+
+        // Inputs every few ticks, some of them refused, a pause with ticks
+        // going by that don't count, and then ticks after it's over. Only
+        // what changed the game is recorded, the pause included.
+        static const enum input_type inputs[] = {
+                INPUT_LEFT, INPUT_CLOCKWISE_ROTATION, INPUT_SOFT_DROP, INPUT_RIGHT, INPUT_RIGHT,
+                INPUT_HOLD, INPUT_COUNTERCLOCKWISE_ROTATION, INPUT_HARD_DROP
+        };
+        int accepted = 0;
+        for (int i=0; i<2000; i++) {
+                if ((i == 100 || i == 200) && tetris_game_input(&g, INPUT_PAUSE)) {
+                        replay_input(&r, INPUT_PAUSE);
+                        accepted++;
+                }
+                if (i % 5 == 0 && tetris_game_input(&g, inputs[i / 5 % 8])) {
+                        replay_input(&r, inputs[i / 5 % 8]);
+                        accepted++;
+                }
+                replay_tick(&r, &g);
+                tetris_game_tick(&g);
+        }
+        replay_end(&r);
+        test_assert_diff(0, accepted, "Replay, inputs taken");
+        test_assert_eq(true, tetris_game_is_over(&g), "Replay, game over");
+        test_assert_eq(true, r.ticks < 1900, "Replay, ticks counted");
+        test_assert_eq(true, ftell(f) < 5 + 8 + 2 * accepted, "Replay, size");
+
+        rewind(f);
+        uint64_t ticks;
+        test_assert_eq(true, replay_play(f, &replayed, &ticks), "Replay, played");
+        test_assert_eq(r.ticks, ticks, "Replay, ticks played");
+        test_assert_eq(0, memcmp(&g, &replayed, sizeof(g)), "Replay, same game");
+
+        // Cut short, it plays up to there; anything else doesn't play
+        static char bytes[256];
+        rewind(f);
+        size_t size = fread(bytes, 1, sizeof(bytes), f);
+        fclose(f);
+        f = fmemopen(bytes, size / 2, "rb");
+        test_assert_eq(true, replay_play(f, &replayed, &ticks), "Replay, cut short");
+        test_assert_eq(true, ticks < r.ticks, "Replay, cut short ticks");
+        fclose(f);
+        bytes[3]++;
+        f = fmemopen(bytes, size, "rb");
+        test_assert_eq(false, replay_play(f, &replayed, &ticks), "Replay, not a replay");
+        fclose(f);
+
+        fprintf(stderr, "Replays are correct\n");
+}
+
+static void test_row_clear(struct tetris_game *g) {
+        test_single_row(g);
+        test_double_row(g);
+        test_triple_row(g);
+        test_tetris_row(g);
+        test_irregular_rows(g);
+        test_irregular_rows_2(g);
+        test_split_rows(g);
         
         fprintf(stderr, "Row clearing is correct\n");
 }
@@ -1995,21 +5680,108 @@ static void test_row_clear(void) {
 
 // Main
 
-int main(void) {
+int main(int argc, char **argv) {
+        enum tetris_rotation_system rotation_system = TETRIS_ROTATION_SRS;
+        const char *record_filename = NULL;
+        for (int i=1; i<argc; i++) {
+                if (strcmp(argv[i], "--tick-stats") == 0) {
+                        print_tick_stats_at_exit = true;
+                } else if (strcmp(argv[i], "--srs") == 0) {
+                        rotation_system = TETRIS_ROTATION_SRS;
+                } else if (strcmp(argv[i], "--srs-plus") == 0) {
+                        rotation_system = TETRIS_ROTATION_SRS_PLUS;
+                } else if (strcmp(argv[i], "--ars") == 0) {
+                        rotation_system = TETRIS_ROTATION_ARS;
+                } else if (strcmp(argv[i], "--ansi") == 0) {
+                        render_backend = RENDER_ANSI;
+                } else if (strcmp(argv[i], "--half-blocks") == 0) {
+                        half_blocks = true;
+                } else if (strcmp(argv[i], "--leaderboard") == 0) {
+                        print_leaderboard();
+                        return EXIT_SUCCESS;
+                } else if (strcmp(argv[i], "--stats") == 0) {
+                        return print_stats();
+                } else if (strncmp(argv[i], "--record=", 9) == 0) {
+                        record_filename = argv[i] + 9;
+                } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+                        return print_replay(argv[i] + 9);
+                } else if (!parse_timing(argv[i])) {
+                        fprintf(stderr, "usage: %s [--srs | --srs-plus | --ars] [--ansi] [--half-blocks] [--tick-stats] [--record=FILE] [--timing=ACTION:DAS:ARR | --timing=ACTION:off]...\n", argv[0]);
+                        fprintf(stderr, "       %s --leaderboard | --stats | --replay=FILE\n", argv[0]);
+                        fprintf(stderr, "actions: left, right, soft-drop, cw, ccw, hard-drop, hold; times in ms\n");
+                        return EXIT_FAILURE;
+                }
+        }
+        
+        init_tracing();
         init_hiscore();
         atexit(save_hiscore);
-        
-        srandom(time(NULL));
-        init_shuffle_pieces();
-        current_piece = next_random_piece();
-        update_shadow_location();
+        atexit(print_tick_stats);
+        atexit(save_phase_histograms);
+
+        struct tetris_game game;
+        uint64_t seed = time(NULL);
+        tetris_game_init(&game, seed);
+        tetris_game_set_rotation_system(&game, rotation_system);
 
 #ifdef DEBUG
-        test_rng();
-        test_row_clear();
+        test_rng(&game);
+        test_bag_positions();
+        test_shapes(&game);
+        test_collision(&game);
+        test_rotation(&game);
+        test_surface(&game);
+        test_row_clear(&game);
+        test_gravity();
+        test_independent_games();
+        test_unchanged_inputs();
+        test_held_actions();
+        test_ansi_present();
+        test_trace_threads();
+        test_snapshots();
+        test_leaderboard();
+        test_history();
+        test_history_checkpoints();
+        test_saved_game();
+        test_replay();
+        test_recording_keeps_save();
         return EXIT_SUCCESS;
 #endif
+#ifdef RENDER_BENCH
+        return render_bench();
+#endif
+        
+        // A recording starts from a new game, any saved one is left for later
+        // and isn't replaced when this one is quit
+        long resumed_us = -1;
+        if (record_filename != NULL) {
+                static char replay_buffer[REPLAY_BUFFER_SIZE];
+                FILE *f = fopen(record_filename, "wb");
+                if (f == NULL) {
+                        perror(record_filename);
+                        return EXIT_FAILURE;
+                }
+                setvbuf(f, replay_buffer, _IOFBF, sizeof(replay_buffer));
+                replay_start(&recorder, f, seed, rotation_system);
+                atexit(finish_recording);
+        } else {
+                resumed_us = resume_game(&game);
+        }
+        played.game = &game;
+        played.start_us = now_us() - (resumed_us > 0 ? resumed_us : 0);
+        played.recording = record_filename != NULL;
+
+        // Installed first so that ncurses leaves it alone, we read the
+        // terminal ourselves and getch() never gets to see KEY_RESIZE
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_sigwinch;
+        sigaction(SIGWINCH, &sa, NULL);
+        sa.sa_handler = handle_quit_signal;
+        sigaction(SIGHUP, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
         
+        setlocale(LC_ALL, "");
         initscr();
         atexit(endwin_wrapper);
         
@@ -2017,18 +5789,71 @@ int main(void) {
         
         noecho();
         raw();
-        nodelay(stdscr, true);
-        keypad(stdscr, true);
         curs_set(0);
+        refresh();
+        setup_screen();
+        
+        fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+        enable_kitty_keyboard();
+
+        // From here on this thread runs the game, and never draws
+        start_render_thread();
+        atexit(stop_render_thread);
+        
+        // Sleep until a key comes in or the next tick is due. While paused
+        // the timer is stopped, so only a key can wake us up.
+        scheduler.timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (scheduler.timer == -1) {
+                endwin();
+                perror("timerfd_create");
+                exit(EXIT_FAILURE);
+        }
+        scheduler_set_running(&scheduler, true);
         
+        struct pollfd fds[2] = {
+                {STDIN_FILENO, POLLIN, 0},
+                {scheduler.timer, POLLIN, 0}
+        };
         for (;;) {
-                draw_screen();
-                process_input();
-                step();
+                publish_game(&game);
+
+                // Held keys may need to repeat before the next tick
+                struct timespec timeout;
+                long now = now_us();
+                long next_held_us = next_held_action_us(now);
+                if (next_held_us != -1) {
+                        long wait = next_held_us - now;
+                        if (wait < 0)
+                                wait = 0;
+                        timeout.tv_sec = wait / 1000000L;
+                        timeout.tv_nsec = wait % 1000000L * 1000L;
+                }
+                
+                if (quit_requested)
+                        exit(EXIT_SUCCESS);
+                long start = now_ns();
+                if (ppoll(fds, 2, next_held_us != -1 ? &timeout : NULL, &game_wait_mask) == -1 && errno != EINTR) {
+                        endwin();
+                        perror("ppoll");
+                        exit(EXIT_FAILURE);
+                }
+                phase_end(PHASE_WAIT, &start);
+                
+                scheduler_run(&scheduler, &game);
+                phase_end(PHASE_STEP, &start);
+                process_input(&game);
+                phase_end(PHASE_INPUT, &start);
+                
+                if (game.score > hiscore)
+                        hiscore = game.score;
+                if (tetris_game_is_over(&game))
+                        gameover_loop(&game);
 
-                usleep(DELAY_US);
-                refresh();
+                if (scheduler.running == game.paused)
+                        scheduler_set_running(&scheduler, !game.paused);
         }
 
         return EXIT_SUCCESS;
 }
+
+#endif /* TETRIS_LIBRARY */
@@ -0,0 +1,162 @@
+#ifndef TETROMINOES_H
+#define TETROMINOES_H
+
+// Game engine of tetrominoes. Everything about a game lives in a struct
+// tetris_game, so any number of them can be played side by side. Build
+// libtetrominoes.a to link the engine without the ncurses frontend.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+
+// Defines
+
+#define TETRIS_TICK_US 30000L
+
+#define TETRIS_PLAYFIELD_X 10
+#define TETRIS_PLAYFIELD_Y 40 // this will be drawn as half this value but internally as this value
+#define TETRIS_PLAYFIELD_FLOOR_ROWS 4
+
+
+
+// enums, structs
+
+enum tetris_color {
+        TETRIS_COLOR_BLACK,
+        TETRIS_COLOR_CYAN,
+        TETRIS_COLOR_YELLOW,
+        TETRIS_COLOR_PURPLE,
+        TETRIS_COLOR_GREEN,
+        TETRIS_COLOR_RED,
+        TETRIS_COLOR_BLUE,
+        TETRIS_COLOR_ORANGE,
+        TETRIS_COLOR_WHITE
+};
+
+enum tetrimino {
+        TETRIMINO_TEST,
+        TETRIMINO_I,
+        TETRIMINO_O,
+        TETRIMINO_T,
+        TETRIMINO_S,
+        TETRIMINO_Z,
+        TETRIMINO_J,
+        TETRIMINO_L
+};
+
+enum tetrimino_rotation {
+        SPAWN_ROTATED,
+        CLOCKWISE_ROTATED,
+        TWICE_ROTATED,
+        COUNTER_ROTATED
+};
+
+// How pieces get kicked around when they can't rotate in place. Only the
+// kicks change, pieces keep the same shapes under all of them.
+enum tetris_rotation_system {
+        TETRIS_ROTATION_SRS,
+        TETRIS_ROTATION_SRS_PLUS,
+        TETRIS_ROTATION_ARS
+};
+
+enum input_type {
+        INPUT_NONE,
+        INPUT_CLOCKWISE_ROTATION,
+        INPUT_HARD_DROP,
+        INPUT_HOLD,
+        INPUT_COUNTERCLOCKWISE_ROTATION,
+        INPUT_SOFT_DROP,
+        INPUT_LEFT,
+        INPUT_RIGHT,
+        INPUT_PAUSE,
+        INPUT_EXIT
+};
+
+struct point {
+        int x;
+        int y;
+};
+
+// Rows cleared by the last locked piece, from the bottom up
+struct line_clear {
+        int count;
+        int rows[4];
+};
+
+// The whole state of a game. It holds no pointers, so it can be copied
+// around freely. Read it as much as needed, but only change it through the
+// functions below.
+struct tetris_game {
+        uint32_t playfield[TETRIS_PLAYFIELD_Y + TETRIS_PLAYFIELD_FLOOR_ROWS];
+        enum tetris_color playfield_colors[TETRIS_PLAYFIELD_Y][TETRIS_PLAYFIELD_X]; // only used for drawing
+        int playfield_top; // highest row with any block in it
+        int column_tops[TETRIS_PLAYFIELD_X]; // highest row with a block in each column, the lowest empty cell is just above
+
+        struct line_clear last_line_clear;
+
+        enum tetrimino spawn_order[14];
+        int spawn_next_i;
+        uint64_t rng_state;
+
+        enum tetrimino current_piece;
+        enum tetrimino_rotation current_piece_rotation;
+        struct point current_piece_location;
+        struct point current_shadow_location;
+
+        enum tetrimino current_held_piece;
+
+        enum tetris_rotation_system rotation_system;
+
+        bool can_hold;
+        bool hard_dropped;
+        bool last_movement_was_spin;
+
+        bool paused;
+        bool game_over;
+
+        long score;
+        unsigned level;
+        int goal;
+        int lines; // cleared so far
+
+        uint32_t gravity_progress; // fraction of a row fallen so far, 16.16 fixed point
+};
+
+
+
+// Game functions
+
+// Start a new game, all of its randomness comes from seed
+void tetris_game_init(struct tetris_game *g, uint64_t seed);
+
+// Apply a player action right away. Returns false if it didn't change the
+// game, which is the case for INPUT_NONE and INPUT_EXIT (quitting is left
+// to the caller), for anything but INPUT_PAUSE while paused or after a
+// hard drop, and for a move, rotation or hold that can't be made.
+bool tetris_game_input(struct tetris_game *g, enum input_type input);
+
+// Advance the game by TETRIS_TICK_US
+void tetris_game_tick(struct tetris_game *g);
+
+// Games start with SRS
+void tetris_game_set_rotation_system(struct tetris_game *g, enum tetris_rotation_system system);
+
+bool tetris_game_is_over(const struct tetris_game *g);
+
+// Whether g holds a game the functions above can go on with, for games read
+// back from somewhere else
+bool tetris_game_is_valid(const struct tetris_game *g);
+
+// Color of a locked block, TETRIS_COLOR_BLACK if the cell is empty
+enum tetris_color tetris_game_cell(const struct tetris_game *g, int x, int y);
+
+// The n-th upcoming piece, n from 0 to 6
+enum tetrimino tetris_game_next_piece(const struct tetris_game *g, int n);
+
+enum tetris_color tetris_piece_color(enum tetrimino t);
+
+// Whether the 4x4 box of a piece has a block at x, y
+bool tetris_piece_cell(enum tetrimino t, enum tetrimino_rotation r, int x, int y);
+
+#endif /* TETROMINOES_H */